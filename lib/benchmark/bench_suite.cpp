@@ -0,0 +1,51 @@
+// bench_suite.cpp
+//
+#include "bench_suite.h"
+#include "ntp_server.h"
+#include "time_select.h"
+#include "gps_time.h"
+#include "TinyGPSPlus.h"
+
+const uint8_t benchRequest[48] = {0x1b, 0, 17};
+
+const char benchNmea[] =
+  "$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*6A\r\n"
+  "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n";
+
+static void makeResponse(void* arg) {
+  ntp_packet_t reply;
+  NTP_Server::makeResponse(benchRequest, sizeof(benchRequest), reply);
+}
+
+bench_result_t benchMakeResponse(uint32_t iterations) {
+  return benchmark("makeResponse", makeResponse, NULL, iterations);
+}
+
+static void gpsSetTime(void* arg) {
+  gpssetime(*(Time_Select*) arg, 311299, 23595950, 250, 0);   // 2099-12-31 23:59:59.50
+}
+
+bench_result_t benchGpsSetTime(uint32_t iterations) {
+  Time_Select ts;
+  ts.begin(-20, IPAddress());
+  return benchmark("gpssetime", gpsSetTime, &ts, iterations);
+}
+
+static void determinePrecision(void* arg) {
+  DeterminePrecision();
+}
+
+bench_result_t benchDeterminePrecision(uint32_t iterations) {
+  return benchmark("DeterminePrecision", determinePrecision, NULL, iterations);
+}
+
+static void nmeaIngest(void* arg) {
+  TinyGPSPlus* gpsp = (TinyGPSPlus*) arg;
+  for (const char* c = benchNmea; *c; c++)
+    gpsp->encode(*c);
+}
+
+bench_result_t benchNmeaIngest(uint32_t iterations) {
+  TinyGPSPlus gps;
+  return benchmark("nmea_ingest", nmeaIngest, &gps, iterations);
+}
@@ -0,0 +1,43 @@
+// bench_suite.h
+//
+// Benchmarks of the time critical functions of GNATS. The same suite, with
+// the same fixtures and names, runs on the boards in test/embedded and on
+// the host in test/native, so that utils/benchcmp.py compares like with like.
+//
+#pragma once
+
+#include "benchmark.h"
+
+#if !defined(BENCH_ITERATIONS)
+#define BENCH_ITERATIONS 1000
+#endif
+
+// DeterminePrecision() reads the clock 1024 times, it is run fewer times
+#if !defined(BENCH_PRECISION_ITERATIONS)
+#define BENCH_PRECISION_ITERATIONS 16
+#endif
+
+// Client request as sent by the utilities in utils/ but with a poll
+// exponent of 17, above the largest one advertised by the load governor of
+// the NTP server. Such requests are answered without being booked in the
+// governor's calendar, so every iteration takes the same path whatever
+// the calendar holds.
+extern const uint8_t benchRequest[48];
+
+// RMC and GGA messages with a fix and valid checksums
+extern const char benchNmea[];
+
+// NTP_Server::makeResponse(), the reply built by processUDPPacket()
+// before it is sent, for benchRequest. The calendar walk of the load
+// governor is not timed.
+bench_result_t benchMakeResponse(uint32_t iterations = BENCH_ITERATIONS);
+
+// gpssetime() of a GPS time always ahead of the system clock, with a time
+// source selection that has no peers
+bench_result_t benchGpsSetTime(uint32_t iterations = BENCH_ITERATIONS);
+
+// DeterminePrecision()
+bench_result_t benchDeterminePrecision(uint32_t iterations = BENCH_PRECISION_ITERATIONS);
+
+// TinyGPSPlus::encode() of every character of benchNmea
+bench_result_t benchNmeaIngest(uint32_t iterations = BENCH_ITERATIONS);
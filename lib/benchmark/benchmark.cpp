@@ -0,0 +1,92 @@
+// benchmark.cpp
+//
+#include "benchmark.h"
+
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#if defined(CONFIG_IDF_TARGET_ESP32C3)
+#include "esp32c3/rom/cache.h"
+#elif defined(CONFIG_IDF_TARGET_ESP32S3)
+#include "esp32s3/rom/cache.h"
+#endif
+#define BENCH_TARGET CONFIG_IDF_TARGET
+#define cycleCount() ESP.getCycleCount()
+#define cpuMhz() getCpuFrequencyMhz()
+#define benchPrintf Serial.printf
+#else
+// Host build of the native environment: the monotonic clock is read in
+// nanoseconds, reported as the cycles of a 1000 MHz CPU
+#define BENCH_TARGET "native"
+static uint32_t cycleCount(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+#define cpuMhz() 1000
+#define benchPrintf printf
+#define IRAM_ATTR
+#endif
+
+// Larger than the data cache of the ESP32-S3 (up to 64 KB). It must be
+// const but not volatile: GCC places const volatile objects in .data, that
+// is in DRAM, while const objects go to .rodata which the ESP32 linker
+// scripts map to flash (.flash.rodata). The reads go through a volatile
+// pointer instead so that they are not optimized away.
+#define EVICT_SIZE 65536
+#define CACHE_LINE 32
+
+static const uint8_t __evict[EVICT_SIZE] = {1};
+
+// In IRAM so that it does not run from the flash whose cache it invalidates
+void IRAM_ATTR evictCache(void) {
+  const volatile uint8_t* p = __evict;
+  volatile uint32_t sum = 0;
+  for (uint32_t i = 0; i < EVICT_SIZE; i += CACHE_LINE)
+    sum += p[i];
+  #if defined(CONFIG_IDF_TARGET_ESP32C3) || defined(CONFIG_IDF_TARGET_ESP32S3)
+  // The instruction cache is never dirty, it can be invalidated at any time.
+  // On the ESP32-C3 it also caches the data in flash.
+  Cache_Invalidate_ICache_All();
+  #endif
+}
+
+static int compareCycles(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*) a;
+  uint32_t y = *(const uint32_t*) b;
+  return (x > y) - (x < y);
+}
+
+bench_result_t benchmark(const char* name, bench_fn_t fn, void* arg, uint32_t iterations) {
+  bench_result_t res = {name, iterations, 0, 0, 0, 0, 0};
+  uint32_t* runs = (uint32_t*) malloc(iterations * sizeof(uint32_t));
+  if ((!runs) || (!iterations)) {
+    benchPrintf("BENCH {\"name\":\"%s\",\"error\":\"out of memory\"}\n", name);
+    free(runs);
+    return res;
+  }
+
+  evictCache();
+  uint32_t start = cycleCount();
+  fn(arg);
+  res.cold = cycleCount() - start;
+
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    start = cycleCount();
+    fn(arg);
+    runs[i] = cycleCount() - start;
+    total += runs[i];
+  }
+  qsort(runs, iterations, sizeof(uint32_t), compareCycles);
+  res.min = runs[0];
+  res.median = runs[iterations/2];
+  res.max = runs[iterations - 1];
+  res.mean = total / iterations;
+  free(runs);
+
+  benchPrintf("BENCH {\"target\":\"%s\",\"name\":\"%s\",\"mhz\":%u,\"iter\":%u,"
+    "\"cold\":%u,\"min\":%u,\"median\":%u,\"mean\":%u,\"max\":%u}\n",
+    BENCH_TARGET, name, cpuMhz(), iterations,
+    res.cold, res.min, res.median, res.mean, res.max);
+  return res;
+}
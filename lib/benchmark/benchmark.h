@@ -0,0 +1,40 @@
+// benchmark.h
+//
+// Measures the number of CPU cycles taken by a function on the ESP32-C3
+// (RISC-V) or ESP32-S3 (Xtensa) using the cycle counter read by
+// ESP.getCycleCount(). In the native environment the host monotonic clock
+// is used instead, one "cycle" per nanosecond, and the target is "native".
+//
+// Each benchmark is run once after evicting the caches (cold) and then
+// a number of times in a row (warm). The result is printed on the serial
+// monitor as a single line
+//
+//   BENCH {"target":"esp32c3","name":"gpssetime","mhz":160,"iter":1000,"cold":...,"min":...,"median":...,"mean":...,"max":...}
+//
+// which utils/benchcmp.py compares to stored baselines.
+//
+#pragma once
+
+#include "Arduino.h"
+
+typedef void (*bench_fn_t)(void* arg);
+
+typedef struct {
+  const char* name;
+  uint32_t iterations;
+  uint32_t cold;           // cycles of the single run after evicting the cache
+  uint32_t min;            // cycles of the warm runs
+  uint32_t median;
+  uint32_t mean;
+  uint32_t max;
+} bench_result_t;
+
+// Evicts the code and data in flash from the caches: the instruction cache
+// is invalidated with the ROM cache API and enough data is read from flash
+// to evict the data cache of the ESP32-S3. The data cache is not
+// invalidated as it may hold lines of the PSRAM not yet written back. On
+// the host only the data read evicts what it can of the CPU caches.
+void evictCache(void);
+
+// Runs fn(arg) once cold and then iterations times warm and prints the result
+bench_result_t benchmark(const char* name, bench_fn_t fn, void* arg, uint32_t iterations);
@@ -0,0 +1,40 @@
+// gps_time.cpp
+//
+#include "gps_time.h"
+#include <time.h>
+#include "smalldebug.h"
+
+void gpstime(uint32_t gpsDate, uint32_t gpsTime, uint32_t gpsAge, timeval* tv) {
+  struct tm timeinfo;
+
+  div_t delta = div( (gpsTime % 100)*10 + gpsAge, 1000);
+  timeinfo.tm_sec = (gpsTime / 100) % 100 + delta.quot;
+  timeinfo.tm_min = (gpsTime / 10000) % 100;
+  timeinfo.tm_hour = gpsTime / 1000000;
+  timeinfo.tm_mday = gpsDate / 10000;
+  timeinfo.tm_mon = ((gpsDate / 100) % 100) - 1;
+  timeinfo.tm_year = (2000 - 1900) + (gpsDate % 100);
+  timeinfo.tm_wday = -1;
+  timeinfo.tm_yday = -1;
+  timeinfo.tm_isdst = 0;  // UTC does not have daylight saving time
+  // mktime returns the epoch representing the values in the tm structure timeinfo
+  // which it interprets as a **local** time.
+  setenv("TZ", "UTC0", 1);  // revert to UTC time
+  tv->tv_sec = mktime(&timeinfo);  // calculates epoch, normalizing tm_sec
+  tv->tv_usec = 1000 * delta.rem; // milliseconds to microseconds
+}
+
+bool gpssetime(Time_Select& ts, uint32_t gpsDate, uint32_t gpsTime, uint32_t gpsAge, time_t notBefore) {
+  DBGF("gpssetime date: %u, time: %u\n", gpsDate, gpsTime);
+  timeval tv, tv_now;
+  gettimeofday(&tv_now, NULL);
+  gpstime(gpsDate, gpsTime, gpsAge, &tv);
+  if (tv.tv_sec <= notBefore) {
+    DBG("*** Error: Time going backward ***");
+    return false;
+  }
+  double offset = (tv.tv_sec - tv_now.tv_sec) + (tv.tv_usec - tv_now.tv_usec)/1e6;
+  DBGF("GPS time offset: %.6f s\n", offset);
+  ts.gpsSample(offset);
+  return true;
+}
@@ -0,0 +1,22 @@
+// gps_time.h
+//
+// Conversion of the date and time decoded by TinyGPSPlus from the NMEA
+// messages of the GPS receiver to a timeval, and GPS samples for the time
+// source selection.
+//
+#pragma once
+
+#include "Arduino.h"
+#include <sys/time.h>
+#include "time_select.h"
+
+// Converts the given GPS data, which is UTC time to the nearest centisecond,
+// to a timeval using gpsAge, the number of milliseconds since it was received
+//   gpsDate: DDMMYY as returned by TinyGPSDate::value()
+//   gpsTime: HHMMSSCC as returned by TinyGPSTime::value()
+void gpstime(uint32_t gpsDate, uint32_t gpsTime, uint32_t gpsAge, timeval* tv);
+
+// Passes the offset of the given GPS time from the system clock to the time
+// source selection ts which steers the clock. Returns false, without a
+// sample, when the GPS time is not after notBefore.
+bool gpssetime(Time_Select& ts, uint32_t gpsDate, uint32_t gpsTime, uint32_t gpsAge, time_t notBefore);
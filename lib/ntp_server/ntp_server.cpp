@@ -4,8 +4,9 @@
 //   @ https://github.com/ElektorLabs/180662-mini-NTP-ESP32/tree/master/Firmware/src
 //
 // Instead of using callbacks to getUTCTime() and getSubsecond(), this server reads
-// the ESP RTC directly with microsecond precision. Outside time sources (presently
-// there is only a GPS receiver) are used to update the ESP RTC at regular intervals.
+// the ESP RTC directly with microsecond precision. Outside time sources (a GPS
+// receiver and NTP servers on the LAN, see lib/time_select) are used to update
+// the ESP RTC at regular intervals and to set the advertised system variables.
 //
 // References:
 //   Get Current Time in ESP-IDF Programming - Guide System Time
@@ -17,55 +18,12 @@
 #include "Arduino.h"
 #include "ntp_server.h"
 #include <lwip/def.h>
+#include <atomic>
 #include "smalldebug.h"
 
 // The UNIX epoch starts on 1.1.1970 and the NTP epoch starts on 1.1.1900
 #define NTP_TIMESTAMP_DELTA  2208988800ull   // 70 years worth of seconds
 
-typedef struct{
-    uint8_t mode:3;               // mode. Three bits. Client will pick mode 3 for client.
-    uint8_t vn:3;                 // vn.   Three bits. Version number of the protocol.
-    uint8_t li:2;                 // li.   Two bits.   Leap indicator.
-}ntp_flags_t;
-
-typedef union {
-    uint32_t data;
-    uint8_t byte[4];
-    char c_str[4];
-} refID_t;
-
-typedef struct {
-  ntp_flags_t flags;
-  uint8_t stratum;         // Eight bits. Stratum level of the local clock.
-  uint8_t poll;            // Eight bits. Maximum interval between successive messages.
-  int8_t  precision;       // Eight bits signed. Precision of the local clock.
-
-  uint32_t rootDelay;      // 32 bits. Total round trip delay time.
-  uint32_t rootDispersion; // 32 bits. Max error allowed from primary clock source.
-  refID_t refId;           // 32 bits. Reference clock identifier.
-
-  // Reference Timestamp: Time when the system clock was last set or
-  // corrected, in NTP timestamp format.
-  uint32_t refTm_s;        // 32 bits. Reference time-stamp seconds.
-  uint32_t refTm_f;        // 32 bits. Reference time-stamp fraction of a second.
-
-  // Origin Timestamp: Time at the client when the request departed
-  // for the server, in NTP timestamp format.
-  uint32_t origTm_s;       // 32 bits. Origin time-stamp seconds.
-  uint32_t origTm_f;       // 32 bits. Origin time-stamp fraction of a second.
-
-  // Receive Timestamp: Time at the server when the request arrived
-  // from the client, in NTP timestamp format.
-  uint32_t rxTm_s;         // 32 bits. Received time-stamp seconds.
-  uint32_t rxTm_f;         // 32 bits. Received time-stamp fraction of a second.
-
-  // Transmit Timestamp: Time at the server when the response left
-  // for the client, in NTP timestamp format.
-  uint32_t txTm_s;         // 32 bits and the most important field the client cares about. Transmit time-stamp seconds.
-  uint32_t txTm_f;         // 32 bits. Transmit time-stamp fraction of a second.
-
-} ntp_packet_t;
-
 #if (ENABLE_DBG > 0)
 void dumpNTP_packet(char * msg, ntp_packet_t ntpp) {
   DBG(msg);
@@ -148,6 +106,9 @@ int8_t DeterminePrecision( void ){
     if (end - start < run)
       run = end - start;
   }
+  // no less than the resolution of micros(), log2(0) is not a number
+  if (!run)
+    run = 1;
   double runtime = (double) ((double) run / 1000000.0);
   __calloverhead = log2(runtime);
   DBGF("DeterminePrecision: run: %u, runtime: %f, __calloverhead %d\n", run, runtime, __calloverhead);
@@ -155,55 +116,279 @@ int8_t DeterminePrecision( void ){
 }
 
 
-AsyncUDP udp;
+// Packet counters for each interface and address family. All AsyncUDP
+// listeners are serviced by the same task so there is a single writer.
+// The last row collects packets from an unknown interface.
+static ntp_counters_t __counters[TCPIP_ADAPTER_IF_MAX+1][2] = {};
+
+static ntp_counters_t& __countersOf(tcpip_adapter_if_t intf, bool isIPv6) {
+  if (intf > TCPIP_ADAPTER_IF_MAX)
+    intf = TCPIP_ADAPTER_IF_MAX;
+  return __counters[intf][isIPv6 ? NTP_FAMILY_IPV6 : NTP_FAMILY_IPV4];
+}
+
+// System variables advertised in responses. They are set from the loop task
+// and read by the AsyncUDP task, hence the spinlock.
+typedef struct {
+  uint8_t li;
+  uint8_t stratum;
+  uint32_t refId;            // network byte order
+  struct timeval refTime;
+  uint32_t rootDelay;        // NTP short format (16.16 s), host byte order
+  uint32_t rootDisp;         // NTP short format (16.16 s), host byte order
+} ntp_reference_t;
+
+static ntp_reference_t __reference = {3, 16, 0, {0, 0}, 0, 0};
+static portMUX_TYPE __referenceMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Converts seconds to the NTP short format
+static uint32_t toShort(double sec) {
+  if (sec <= 0)
+    return 0;
+  if (sec >= 65535.0)
+    return 0xFFFFFFFF;
+  return (uint32_t) (sec * 65536.0);
+}
 
 NTP_Server::NTP_Server( ){
+  _listeners = 0;
+  memcpy(&__reference.refId, "INIT", 4);
 }
 
 NTP_Server::~NTP_Server(){
+  for (uint8_t i = 0; i < _listeners; i++)
+    _udp[i].close();
 }
 
 bool NTP_Server::begin(uint16_t port){
   DeterminePrecision();
-  if (udp.listen(port)) {
-    udp.onPacket(NTP_Server::processUDPPacket);
+  // One listener per address family. lwIP allows an IPv4 and an IPv6
+  // pcb bound to the same port when neither is bound to IP_ANY_TYPE.
+  // It refuses (ERR_USE) any other pcb of the same family on that port,
+  // so there can be no additional listener bound to a single interface.
+  bool ok = listen(IPAddress(0, 0, 0, 0), port);
+  #if (ENABLE_IPV6 > 0)
+  ok = listen(IPv6Address(), port) || ok;
+  #endif
+  return ok;
+}
+
+bool NTP_Server::listen(const IPAddress& addr, uint16_t port){
+  if (_listeners >= NTP_MAX_LISTENERS)
+    return false;
+  if (_udp[_listeners].listen(addr, port)) {
+    _udp[_listeners++].onPacket(NTP_Server::processUDPPacket);
+    DBGF("NTP_Server listening on %s:%d\n", addr.toString().c_str(), port);
+    return true;
+  }
+  return false;
+}
+
+bool NTP_Server::listen(const IPv6Address& addr, uint16_t port){
+  if (_listeners >= NTP_MAX_LISTENERS)
+    return false;
+  if (_udp[_listeners].listen(addr, port)) {
+    _udp[_listeners++].onPacket(NTP_Server::processUDPPacket);
+    DBGF("NTP_Server listening on [%s]:%d\n", addr.toString().c_str(), port);
     return true;
   }
   return false;
 }
 
 /* static function */
-void NTP_Server::processUDPPacket(AsyncUDPPacket& packet) {
+const ntp_counters_t& NTP_Server::counters(tcpip_adapter_if_t intf, uint8_t family) {
+  return __countersOf(intf, family == NTP_FAMILY_IPV6);
+}
+
+/*
+  Load governor
+
+  The time between requests and the time spent answering a request are
+  tracked with exponentially weighted moving averages updated with compare
+  and swap loops. Together with the budgets they set how many requests can
+  be expected in a second.
+
+  A calendar counts the requests expected in each of the next seconds, as
+  booked by earlier replies. Each reply advertises the smallest poll
+  exponent, not less than the one of the client, for which the second of
+  the next request still has room, and books it. The exponent is decided
+  for each request, so it rises by as many steps as needed at once when the
+  load is far over budget and drops as soon as there is room again. As the
+  requests of a burst are booked into different seconds, clients that
+  started together are spread out instead of backing off together.
+*/
+
+#define NTP_MAXPOLL 11          // 34 min, largest poll exponent advertised
+#define CALENDAR_SIZE (2UL << NTP_MAXPOLL) // seconds, more than the largest poll interval
+#define EWMA_SHIFT  4           // weight of a new sample is 1/16
+#define LOAD_TARGET 400         // permille of the budget booked in a second
+#define MAX_INTERVAL 60000000UL // µs, cap on the time between requests
+
+static std::atomic<uint32_t> __lastArrival(0);              // micros() of the last request
+static std::atomic<uint32_t> __avgInterval(MAX_INTERVAL);   // µs between requests
+static std::atomic<uint32_t> __avgService(0);               // µs to answer a request
+static std::atomic<uint8_t> __lastPoll(0);                  // exponent of the last raised poll field
+static std::atomic<uint8_t> __calendar[CALENDAR_SIZE];      // requests booked in a second
+static std::atomic<uint32_t> __calendarStart(0);            // millis() at the start of the current second
+static std::atomic<uint32_t> __calendarSecond(0);           // current second, modulo CALENDAR_SIZE
+
+static uint32_t ewma(std::atomic<uint32_t>& avg, uint32_t sample) {
+  uint32_t old = avg.load(std::memory_order_relaxed);
+  uint32_t val;
+  do {
+    val = old - (old >> EWMA_SHIFT) + (sample >> EWMA_SHIFT);
+  } while (!avg.compare_exchange_weak(old, val, std::memory_order_relaxed));
+  return val;
+}
+
+// Smallest acceptable average time between requests in µs, set by
+// NTP_RATE_BUDGET or by the service time and NTP_BUSY_BUDGET, whichever
+// is larger
+static uint32_t __minInterval(uint32_t service) {
+  uint32_t minInterval = 1000000UL / NTP_RATE_BUDGET;
+  uint32_t busyInterval = (service * 100) / NTP_BUSY_BUDGET;
+  return (busyInterval > minInterval) ? busyInterval : minInterval;
+}
+
+// Load in permille of the budget
+static uint32_t __load(uint32_t interval, uint32_t service) {
+  if (!interval)
+    interval = 1;
+  return ((uint64_t) __minInterval(service) * 1000) / interval;
+}
+
+// Requests that can be booked in a second. Clients randomize their poll
+// intervals, so the requests in a second vary around the number booked
+// and only LOAD_TARGET of the budget is booked.
+static uint32_t __capacity(uint32_t service) {
+  uint32_t cap = ((uint64_t) LOAD_TARGET * 1000) / __minInterval(service);
+  if (cap < 1)
+    cap = 1;
+  return (cap > 255) ? 255 : cap;
+}
+
+// Moves the calendar to the second of now_ms, clearing the seconds that
+// have passed, and returns the current second
+static uint32_t __calendarNow(uint32_t now_ms) {
+  uint32_t start = __calendarStart.load(std::memory_order_relaxed);
+  uint32_t second = __calendarSecond.load(std::memory_order_relaxed);
+  uint32_t elapsed = (now_ms - start) / 1000;
+  if (!elapsed)
+    return second;
+  // only one caller moves the calendar
+  if (!__calendarStart.compare_exchange_strong(start, start + elapsed*1000))
+    return __calendarSecond.load(std::memory_order_relaxed);
+  uint32_t n = (elapsed < CALENDAR_SIZE) ? elapsed : CALENDAR_SIZE;
+  for (uint32_t i = 0; i < n; i++)
+    __calendar[(second + i) % CALENDAR_SIZE].store(0, std::memory_order_relaxed);
+  second = (second + elapsed) % CALENDAR_SIZE;
+  __calendarSecond.store(second, std::memory_order_relaxed);
+  return second;
+}
+
+// Returns the poll exponent to advertise to a client polling with the
+// exponent poll at now_ms and books its next request
+static uint8_t __advertise(uint8_t poll, uint32_t now_ms) {
+  // not booked when the next request is past the end of the calendar
+  if (poll > NTP_MAXPOLL)
+    return poll;
+  uint32_t second = __calendarNow(now_ms);
+  uint32_t cap = __capacity(__avgService.load(std::memory_order_relaxed));
+  uint8_t next = poll;
+  while ((next < NTP_MAXPOLL) &&
+    (__calendar[(second + (1UL << next)) % CALENDAR_SIZE].load(std::memory_order_relaxed) >= cap))
+    next++;
+  std::atomic<uint8_t>& slot = __calendar[(second + (1UL << next)) % CALENDAR_SIZE];
+  if (slot.load(std::memory_order_relaxed) < 255)
+    slot.fetch_add(1, std::memory_order_relaxed);
+  __lastPoll.store((next != poll) ? next : 0, std::memory_order_relaxed);
+  return next;
+}
+
+// Updates the averages with a request that arrived at arrival_us and
+// took service_us to answer
+static void __governor(uint32_t arrival_us, uint32_t service_us) {
+  uint32_t last = __lastArrival.exchange(arrival_us, std::memory_order_relaxed);
+  uint32_t dt = arrival_us - last;
+  if (dt > MAX_INTERVAL)
+    dt = MAX_INTERVAL;
+  ewma(__avgInterval, dt);
+  ewma(__avgService, service_us);
+}
+
+/* static function */
+ntp_load_t NTP_Server::load(void) {
+  ntp_load_t res;
+  res.interval_us = __avgInterval.load(std::memory_order_relaxed);
+  res.service_us = __avgService.load(std::memory_order_relaxed);
+  res.permille = __load(res.interval_us, res.service_us);
+  res.poll = __lastPoll.load(std::memory_order_relaxed);
+  return res;
+}
+
+/* static function */
+int8_t NTP_Server::precision(void) {
+  return __calloverhead;
+}
+
+/* static function */
+void NTP_Server::setReference(uint8_t li, uint8_t stratum, uint32_t refId,
+  const struct timeval& refTime, double rootDelay, double rootDisp) {
+  ntp_reference_t ref;
+  ref.li = li;
+  ref.stratum = stratum;
+  ref.refId = refId;
+  ref.refTime = refTime;
+  ref.rootDelay = toShort(rootDelay);
+  ref.rootDisp = toShort(rootDisp);
+  portENTER_CRITICAL(&__referenceMux);
+  __reference = ref;
+  portEXIT_CRITICAL(&__referenceMux);
+}
+
+/* static function */
+bool NTP_Server::makeResponse(const uint8_t* request, size_t length, ntp_packet_t& ntp_req) {
   uint32_t start_us = micros();
-  ntp_packet_t ntp_req;
   struct timeval tv_now;
   if (gettimeofday(&tv_now, NULL)) {
     DBG("NTP_Server unable to get time of day");
-    return;  // error
+    return false;  // error
   }
   //DBGF("NTP_Server tv_now = (%u sec, %u usec)\n", tv_now.tv_sec, tv_now.tv_usec);
-  if (packet.length() != sizeof(ntp_packet_t))
-    return; // this is not what we want !
+  if (length != sizeof(ntp_packet_t))
+    return false; // this is not what we want !
 
-  memcpy(&ntp_req, packet.data(), sizeof(ntp_packet_t));
+  memcpy(&ntp_req, request, sizeof(ntp_packet_t));
 
   //dumpNTP_packet("incoming", ntp_req);
 
-  ntp_req.flags.li = 0;   // No impending leap second insertion
+  ntp_reference_t ref;
+  portENTER_CRITICAL(&__referenceMux);
+  ref = __reference;
+  portEXIT_CRITICAL(&__referenceMux);
+
+  ntp_req.flags.li = ref.li; // 0 = no impending leap second, 3 = not synchronized
   ntp_req.flags.vn = 4;   // NTP Version 4
   ntp_req.flags.mode = 4; // Server
-  ntp_req.stratum = 1;
+  ntp_req.stratum = ref.stratum;
 
-  // We don't touch ntp_req.poll
+  // The poll field is left as the client set it unless the load governor
+  // asks the client to back off
+  ntp_req.poll = __advertise(ntp_req.poll, millis());
 
   ntp_req.precision = __calloverhead;
-  ntp_req.rootDelay=1;
-  ntp_req.rootDispersion=1;
-  strncpy(ntp_req.refId.c_str ,"GPS", sizeof(ntp_req.refId.c_str) );
-  // Set to NTP byte order
+  ntp_req.rootDelay = ref.rootDelay;
+  // The root dispersion grows by PHI = 15 ppm, about 983/1000 of a
+  // short format unit per second, since the clock was last corrected
+  ntp_req.rootDispersion = ref.rootDisp;
+  if ((ref.refTime.tv_sec) && (tv_now.tv_sec > ref.refTime.tv_sec)) {
+    uint32_t growth = ((uint64_t) (tv_now.tv_sec - ref.refTime.tv_sec) * 983) / 1000;
+    ntp_req.rootDispersion = (ref.rootDisp > 0xFFFFFFFF - growth) ? 0xFFFFFFFF : ref.rootDisp + growth;
+  }
+  // Set to NTP byte order, refId already is
   ntp_req.rootDelay = htonl( ntp_req.rootDelay );
   ntp_req.rootDispersion = htonl( ntp_req.rootDispersion );
-  ntp_req.refId.data = ntohl( ntp_req.refId.data );
+  ntp_req.refId.data = ref.refId;
 
   // Set the origin Timestamp (origTm) which is the time at the client when
   // the request departed for the server, in NTP timestamp format.
@@ -227,10 +412,14 @@ void NTP_Server::processUDPPacket(AsyncUDPPacket& packet) {
   ntp_req.rxTm_f = htonl(ntp_req.rxTm_f);
 
   // Set reference timestamp (refTm), which is the time when the system clock
-  // was last set or corrected, to the received timestamp (rxTm).
-  // - rxTm is already in NTP byte order
-  ntp_req.refTm_s = ntp_req.rxTm_s;
-  ntp_req.refTm_f = ntp_req.rxTm_f;
+  // was last set or corrected, 0 if it never was.
+  if (ref.refTime.tv_sec) {
+    ntp_req.refTm_s = htonl(ref.refTime.tv_sec + NTP_TIMESTAMP_DELTA);
+    ntp_req.refTm_f = htonl((uint32_t) ( ((uint64_t) ref.refTime.tv_usec << 32) / 1000000L ));
+  } else {
+    ntp_req.refTm_s = 0;
+    ntp_req.refTm_f = 0;
+  }
 
   // Set the transmit timestamp (txTm) which is the time at the server
   // when the response left for the client, in NTP timestamp format.
@@ -242,11 +431,34 @@ void NTP_Server::processUDPPacket(AsyncUDPPacket& packet) {
   // set to NTP byte order
   ntp_req.txTm_s = htonl(ntp_req.txTm_s);
   ntp_req.txTm_f = htonl(ntp_req.txTm_f);
+  return true;
+}
 
-  packet.write((uint8_t*)&ntp_req, sizeof(ntp_packet_t));
+/* static function */
+void NTP_Server::processUDPPacket(AsyncUDPPacket& packet) {
+  uint32_t arrival_us = micros();
+  ntp_packet_t ntp_req;
+  // The reply goes out through packet.write() which sends it back to the
+  // remote address from the interface on which the request arrived
+  ntp_counters_t& cnt = __countersOf(packet.interface(), packet.isIPv6());
+  cnt.requests++;
+  if (!makeResponse(packet.data(), packet.length(), ntp_req)) {
+    cnt.dropped++;
+    return;
+  }
+
+  if (packet.write((uint8_t*)&ntp_req, sizeof(ntp_packet_t)) == sizeof(ntp_packet_t))
+    cnt.responses++;
+  else
+    cnt.dropped++;
+  __governor(arrival_us, micros() - arrival_us);
 
   #if (ENABLE_DBG > 0)
-  DBGF("NTP response sent to %s:%d\n", packet.remoteIP().toString().c_str(), packet.remotePort());
+  if (packet.isIPv6()) {
+    DBGF("NTP response sent to [%s]:%d\n", packet.remoteIPv6().toString().c_str(), packet.remotePort());
+  } else {
+    DBGF("NTP response sent to %s:%d\n", packet.remoteIP().toString().c_str(), packet.remotePort());
+  }
   ntp_req.txTm_s = htonl(ntp_req.txTm_s);
   ntp_req.txTm_f = htonl(ntp_req.txTm_f);
   DBGF("txTm_s %u sec, txTm_f %u fraction\n", ntp_req.txTm_s, ntp_req.txTm_f);
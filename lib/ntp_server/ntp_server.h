@@ -1,11 +1,128 @@
+#pragma once
+
 #include "Arduino.h"
 #include "AsyncUDP.h"
 
+typedef struct{
+    uint8_t mode:3;               // mode. Three bits. Client will pick mode 3 for client.
+    uint8_t vn:3;                 // vn.   Three bits. Version number of the protocol.
+    uint8_t li:2;                 // li.   Two bits.   Leap indicator.
+}ntp_flags_t;
+
+typedef union {
+    uint32_t data;
+    uint8_t byte[4];
+    char c_str[4];
+} refID_t;
+
+typedef struct {
+  ntp_flags_t flags;
+  uint8_t stratum;         // Eight bits. Stratum level of the local clock.
+  uint8_t poll;            // Eight bits. Maximum interval between successive messages.
+  int8_t  precision;       // Eight bits signed. Precision of the local clock.
+
+  uint32_t rootDelay;      // 32 bits. Total round trip delay time.
+  uint32_t rootDispersion; // 32 bits. Max error allowed from primary clock source.
+  refID_t refId;           // 32 bits. Reference clock identifier.
+
+  // Reference Timestamp: Time when the system clock was last set or
+  // corrected, in NTP timestamp format.
+  uint32_t refTm_s;        // 32 bits. Reference time-stamp seconds.
+  uint32_t refTm_f;        // 32 bits. Reference time-stamp fraction of a second.
+
+  // Origin Timestamp: Time at the client when the request departed
+  // for the server, in NTP timestamp format.
+  uint32_t origTm_s;       // 32 bits. Origin time-stamp seconds.
+  uint32_t origTm_f;       // 32 bits. Origin time-stamp fraction of a second.
+
+  // Receive Timestamp: Time at the server when the request arrived
+  // from the client, in NTP timestamp format.
+  uint32_t rxTm_s;         // 32 bits. Received time-stamp seconds.
+  uint32_t rxTm_f;         // 32 bits. Received time-stamp fraction of a second.
+
+  // Transmit Timestamp: Time at the server when the response left
+  // for the client, in NTP timestamp format.
+  uint32_t txTm_s;         // 32 bits and the most important field the client cares about. Transmit time-stamp seconds.
+  uint32_t txTm_f;         // 32 bits. Transmit time-stamp fraction of a second.
+
+} ntp_packet_t;
+
+// Maximum number of UDP listeners, one per address family
+#define NTP_MAX_LISTENERS 2
+
+// Address families counted separately on each interface
+#define NTP_FAMILY_IPV4 0
+#define NTP_FAMILY_IPV6 1
+
+typedef struct {
+  uint32_t requests;       // packets received
+  uint32_t responses;      // responses sent
+  uint32_t dropped;        // malformed packets or failed sends
+} ntp_counters_t;
+
+// Request rate, in requests per second, that the server should not exceed.
+// Clients are asked to poll less often so that no more than 40% of this
+// rate is expected in any second.
+#if !defined(NTP_RATE_BUDGET)
+#define NTP_RATE_BUDGET 50
+#endif
+
+// Largest share of the CPU time, in percent, spent answering requests
+#if !defined(NTP_BUSY_BUDGET)
+#define NTP_BUSY_BUDGET 50
+#endif
+
+typedef struct {
+  uint32_t interval_us;    // average time between requests
+  uint32_t service_us;     // average time to answer a request
+  uint32_t permille;       // load in permille of the budget
+  uint8_t poll;            // poll exponent of the last reply if raised, 0 = none
+} ntp_load_t;
+
+// Measures the time needed to read the system clock, sets the precision
+int8_t DeterminePrecision( void );
+
 class NTP_Server {
 public:
   NTP_Server( );
   ~NTP_Server();
+
+  // Listens on port for IPv4 requests and, if ENABLE_IPV6 > 0, IPv6 requests.
+  // The listeners are bound to the any address so they serve all interfaces
+  // (Wi-Fi station, soft AP and Ethernet). Requests are told apart by the
+  // interface on which they arrived, see counters().
   bool begin(uint16_t port = 123);
+
+  // Number of active listeners
+  uint8_t listeners(void) { return _listeners; }
+
+  // Counters of the packets received on an interface for an address family
+  static const ntp_counters_t& counters(tcpip_adapter_if_t intf, uint8_t family);
+
+  // Load estimated by the governor
+  static ntp_load_t load(void);
+
+  // Precision of the system clock in log2 seconds, valid after begin()
+  static int8_t precision(void);
+
+  // Sets the system variables advertised in responses. Until this is called
+  // the server is not synchronized (leap 3, stratum 16).
+  //   li:        leap indicator, 3 when not synchronized
+  //   stratum:   1 for a reference clock, 16 when not synchronized
+  //   refId:     reference id, network byte order
+  //   refTime:   time when the system clock was last set or corrected
+  //   rootDelay, rootDisp: in seconds, root dispersion when refTime was set
+  static void setReference(uint8_t li, uint8_t stratum, uint32_t refId,
+    const struct timeval& refTime, double rootDelay, double rootDisp);
+
+  // Builds the response to a request of the given length in ntp_req,
+  // returns false if the request is not an NTP packet or if the time
+  // of day is not available. Used by the packet handler and benchmarks.
+  static bool makeResponse(const uint8_t* request, size_t length, ntp_packet_t& ntp_req);
 private:
+  AsyncUDP _udp[NTP_MAX_LISTENERS];
+  uint8_t _listeners;
+  bool listen(const IPAddress& addr, uint16_t port);
+  bool listen(const IPv6Address& addr, uint16_t port);
   static void processUDPPacket(AsyncUDPPacket& packet);
 };
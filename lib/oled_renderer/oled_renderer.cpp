@@ -0,0 +1,149 @@
+// oled_renderer.cpp
+//
+// References:
+//   SSD1306 Advanced Information, Solomon Systech, Rev 1.1, April 2008
+//     - 8.1.5 MCU I2C Interface (control byte)
+//     - 10.1.4 Set Column Address (21h) and 10.1.5 Set Page Address (22h)
+//
+#include "oled_renderer.h"
+#include "smalldebug.h"
+
+#define SSD1306_CTRL_COMMANDS 0x00   // Co = 0, D/C# = 0: the following bytes are commands
+#define SSD1306_CTRL_DATA     0x40   // Co = 0, D/C# = 1: the following bytes are GDDRAM data
+#define SSD1306_COLUMNADDR    0x21
+#define SSD1306_PAGEADDR      0x22
+
+// I2C bytes needed to set the column and page window before a chunk of data
+#define WINDOW_BYTES 7
+
+OLED_Renderer::OLED_Renderer(OLEDDisplay& display, uint8_t address, TwoWire& wire)
+  : _display(display), _wire(wire), _address(address) {
+  _shadow = NULL;
+  _bufferSize = 0;
+  _pages = 0;
+  _page = 0;
+  _sentBytes = 0;
+  _updateBytes = 0;
+  _stallUs = 0;
+  // nothing queued, also when begin() fails
+  for (uint8_t p = 0; p < OLED_MAX_PAGES; p++) {
+    _lo[p] = 0xFF;
+    _hi[p] = 0;
+  }
+}
+
+OLED_Renderer::~OLED_Renderer() {
+  free(_shadow);
+}
+
+bool OLED_Renderer::begin(void) {
+  uint8_t pages = _display.height() / 8;
+  if ((pages > OLED_MAX_PAGES) || (_display.width() > 0xFF) || (!_display.buffer))
+    return false;
+  if (!_shadow)
+    _shadow = (uint8_t*) malloc(_display.width() * pages);
+  if (!_shadow)
+    return false;
+  _pages = pages;
+  _bufferSize = _display.width() * _pages;
+  // the panel shows the content of the display buffer
+  memcpy(_shadow, _display.buffer, _bufferSize);
+  for (uint8_t p = 0; p < _pages; p++) {
+    _lo[p] = 0xFF;
+    _hi[p] = 0;
+  }
+  return true;
+}
+
+void OLED_Renderer::commit(void) {
+  if (!_shadow)
+    return;
+  uint16_t width = _display.width();
+  _stallUs = 0;
+  for (uint8_t p = 0; p < _pages; p++) {
+    uint8_t* src = _display.buffer + p*width;
+    uint8_t* dst = _shadow + p*width;
+    int first = -1;
+    int last = -1;
+    for (uint16_t x = 0; x < width; x++) {
+      if (src[x] != dst[x]) {
+        if (first < 0)
+          first = x;
+        last = x;
+        dst[x] = src[x];
+      }
+    }
+    if (first < 0)
+      continue;
+    // merge with the range still queued for this page, if any
+    if (first < _lo[p])
+      _lo[p] = first;
+    if (last > _hi[p])
+      _hi[p] = last;
+  }
+}
+
+bool OLED_Renderer::pump(void) {
+  if (!_shadow)
+    return false;
+  uint8_t p = _page;
+  uint8_t n = 0;
+  while (_lo[p] > _hi[p]) {
+    p = (p + 1) % _pages;
+    if (++n >= _pages)
+      return false;  // nothing queued
+  }
+
+  uint32_t start = micros();
+  uint8_t col = _lo[p];
+  uint8_t count = _hi[p] - col + 1;
+  if (count > OLED_CHUNK_SIZE)
+    count = OLED_CHUNK_SIZE;
+
+  // The column and page window is set for every chunk so that a later
+  // commit() can widen a range that is partly sent.
+  _wire.beginTransmission(_address);
+  _wire.write(SSD1306_CTRL_COMMANDS);
+  _wire.write(SSD1306_COLUMNADDR);
+  _wire.write(col);
+  _wire.write(col + count - 1);
+  _wire.write(SSD1306_PAGEADDR);
+  _wire.write(p);
+  _wire.write(p);
+  _wire.endTransmission();
+
+  _wire.beginTransmission(_address);
+  _wire.write(SSD1306_CTRL_DATA);
+  _wire.write(_shadow + p*_display.width() + col, count);
+  _wire.endTransmission();
+  _sentBytes += WINDOW_BYTES + 1 + count;
+
+  if (col + count > _hi[p]) {
+    _lo[p] = 0xFF;    // page done
+    _hi[p] = 0;
+    _page = (p + 1) % _pages;
+  } else {
+    _lo[p] = col + count;
+    _page = p;
+  }
+
+  uint32_t elapsed = micros() - start;
+  if (elapsed > _stallUs)
+    _stallUs = elapsed;
+  if (busy())
+    return true;
+  // the update is complete
+  _updateBytes = _sentBytes;
+  _sentBytes = 0;
+  return false;
+}
+
+bool OLED_Renderer::busy(void) {
+  if (!_shadow)
+    return false;
+  for (uint8_t p = 0; p < _pages; p++) {
+    if (_lo[p] <= _hi[p])
+      return true;
+  }
+  return false;
+}
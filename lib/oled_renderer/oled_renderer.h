@@ -0,0 +1,66 @@
+// oled_renderer.h
+//
+// Incremental renderer for SSD1306 I2C OLED displays driven by the ThingPulse
+// OLEDDisplay library.
+//
+// The library's display() pushes the bounding box of all changes over I2C in
+// one blocking call. Instead, commit() compares the drawing buffer of the
+// display with a shadow copy of what is on the panel and queues the changed
+// column range of each 8 pixel high page. pump(), called from loop(), then
+// sends at most one small chunk of a queued range per call so that loop()
+// is never held up by more than one short I2C transaction.
+//
+#pragma once
+
+#include "Arduino.h"
+#include <Wire.h>
+#include "OLEDDisplay.h"
+
+// Maximum number of data bytes sent by a single call to pump(). Must be less
+// than the I2C buffer length of the Wire library less the control byte.
+#if !defined(OLED_CHUNK_SIZE)
+#define OLED_CHUNK_SIZE 32
+#endif
+
+// Maximum number of pages (8 pixel high rows) of the supported displays
+#define OLED_MAX_PAGES 8
+
+class OLED_Renderer {
+public:
+  OLED_Renderer(OLEDDisplay& display, uint8_t address, TwoWire& wire = Wire);
+  ~OLED_Renderer();
+
+  // Call once the panel shows the display buffer, i.e. after display.init()
+  // or display.display()
+  bool begin(void);
+
+  // Queues the differences between the display buffer and the panel content
+  void commit(void);
+
+  // Sends at most one chunk of the queued changes, returns true if more remain
+  bool pump(void);
+
+  // True while there are queued changes not yet sent to the panel
+  bool busy(void);
+
+  // Number of I2C bytes (commands and data) sent by pump() from the time
+  // changes were queued until the queue was last empty
+  uint16_t lastUpdateBytes(void) { return _updateBytes; }
+
+  // Longest time in microseconds spent in a single pump() since the last commit()
+  uint32_t longestStall(void) { return _stallUs; }
+
+private:
+  OLEDDisplay& _display;
+  TwoWire& _wire;
+  uint8_t _address;
+  uint8_t* _shadow;        // panel content once the queued ranges are sent
+  uint16_t _bufferSize;
+  uint8_t _pages;
+  uint8_t _page;           // next page to service, round robin
+  uint8_t _lo[OLED_MAX_PAGES];  // first queued column of each page
+  uint8_t _hi[OLED_MAX_PAGES];  // last queued column, empty when _hi < _lo
+  uint16_t _sentBytes;     // sent since the queue was last empty
+  uint16_t _updateBytes;
+  uint32_t _stallUs;
+};
@@ -0,0 +1,482 @@
+// Time source selection for GNATS
+//
+// The GPS receiver and NTP servers on the LAN are sources of time. Their
+// samples are processed following the reference implementation in
+// Appendix A.5 of RFC 5905, somewhat simplified:
+//   - clock filter: the sample with the lowest delay among the last
+//     TS_NSTAGE samples of a source is used,
+//   - selection: Marzullo's intersection algorithm removes falsetickers,
+//   - cluster: outliers are removed while more than NMIN survivors remain,
+//   - combine: the survivor offsets are averaged, weighted by root distance.
+// There is no clock discipline loop. Large offsets are stepped and small
+// offsets are slewed with adjtime(). Either way the stored samples of all
+// sources are corrected by the same amount so that a correction is applied
+// only once.
+//
+// References:
+//   Network Time Protocol Version 4: Protocol and Algorithms Specification
+//   @ https://www.rfc-editor.org/rfc/rfc5905
+//
+#include "Arduino.h"
+#include "time_select.h"
+#include <sys/time.h>
+#include <errno.h>
+#include "smalldebug.h"
+
+// The UNIX epoch starts on 1.1.1970 and the NTP epoch starts on 1.1.1900
+#define NTP_TIMESTAMP_DELTA  2208988800ull   // 70 years worth of seconds
+
+// RFC 5905 parameters
+#define PHI       15e-6     // s/s, frequency tolerance
+#define MAXDISP   16.0      // s, maximum dispersion
+#define MINDISP   0.005     // s, minimum dispersion increment
+#define MAXDIST   1.5       // s, distance threshold
+#define MAXSTRAT  16        // maximum stratum, unsynchronized
+#define NMIN      3         // minimum number of survivors of the cluster algorithm
+#define STEPT     0.128     // s, offsets larger than this are stepped
+
+#define FRAC      4294967296.0   // 2^32
+
+// Returns the system time as an NTP timestamp in host byte order
+static uint64_t ntpNow(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (((uint64_t) tv.tv_sec + NTP_TIMESTAMP_DELTA) << 32) | (((uint64_t) tv.tv_usec << 32) / 1000000);
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const uint8_t* p) {
+  return ((uint64_t) get32(p) << 32) | get32(p + 4);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  for (int i = 7; i >= 0; i--) {
+    p[i] = v & 0xFF;
+    v >>= 8;
+  }
+}
+
+// Empties the clock filter of a source
+static void clearSource(ts_source_t& p) {
+  p = ts_source_t();
+  p.stratum = MAXSTRAT;
+  for (uint8_t s = 0; s < TS_NSTAGE; s++) {
+    p.filter[s].delay = MAXDISP;
+    p.filter[s].disp = MAXDISP;
+  }
+}
+
+// Seconds since a millis() tick count
+static double age(uint32_t t) {
+  return (millis() - t) / 1000.0;
+}
+
+Time_Select::Time_Select() {
+  _mux = portMUX_INITIALIZER_UNLOCKED;
+  _sources = 0;
+  _precision = -18;
+  _local = 0;
+  _lastPoll = 0;
+  _lastUpdate = 0;
+  _newSample = false;
+  _sysPeer = -1;
+  _stratum = MAXSTRAT;
+  memcpy(&_refId, "INIT", 4);
+  _refTime.tv_sec = 0;
+  _refTime.tv_usec = 0;
+  _rootDelay = 0;
+  _rootDisp = MAXDISP;
+  for (uint8_t i = 0; i < TS_MAX_SOURCES; i++)
+    _rxReady[i] = false;
+}
+
+Time_Select::~Time_Select() {
+  for (uint8_t i = 1; i < _sources; i++)
+    _udp[i].close();
+}
+
+bool Time_Select::begin(int8_t precision, const IPAddress& local) {
+  _precision = precision;
+  _local = (uint32_t) local;
+
+  // Source 0 is the GPS, a stratum 0 reference clock
+  ts_source_t& gps = _src[TS_GPS];
+  clearSource(gps);
+  memcpy(&gps.refId, "GPS", 4);
+  gps.precision = -7;      // 10 ms, NMEA time is given to the nearest centisecond
+  _sources = 1;
+
+  // poll as soon as update() is called
+  _lastPoll = millis() - PEER_POLL_TIME;
+  return true;
+}
+
+bool Time_Select::addPeer(const IPAddress& addr, uint16_t port) {
+  if (_sources >= TS_MAX_SOURCES)
+    return false;
+  uint8_t i = _sources;
+  ts_source_t& p = _src[i];
+  clearSource(p);
+  p.addr = addr;
+  if (!_udp[i].connect(addr, port))
+    return false;
+  _udp[i].onPacket([this, i](AsyncUDPPacket& packet) { receive(i, packet); });
+  _sources++;
+  DBGF("Time source %d: NTP server %s:%d\n", i, addr.toString().c_str(), port);
+  return true;
+}
+
+void Time_Select::gpsSample(double offset) {
+  ts_source_t& gps = _src[TS_GPS];
+  gps.reach |= 1;
+  gps.stratum = 0;
+  clockFilter(TS_GPS, offset, 0, ldexp(1, gps.precision) + ldexp(1, _precision) + GPS_DISPERSION);
+}
+
+bool Time_Select::update(void) {
+  bool polled = false;
+  if (millis() - _lastPoll >= PEER_POLL_TIME) {
+    _lastPoll = millis();
+    poll();
+    polled = true;   // reachability changed
+  }
+  for (uint8_t i = 1; i < _sources; i++) {
+    if (_rxReady[i])
+      process(i);
+  }
+  if (!polled && !_newSample)
+    return false;
+  _newSample = false;
+  clockSelect();
+  return true;
+}
+
+// Shifts the reach registers and sends a client request to each peer
+void Time_Select::poll(void) {
+  uint8_t pkt[48];
+  for (uint8_t i = 0; i < _sources; i++) {
+    _src[i].reach <<= 1;
+    if (i == TS_GPS)
+      continue;  // the GPS is sampled by the caller
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = (4 << 3) | 3;   // li 0, version 4, client mode
+    _src[i].xmt = ntpNow();
+    put64(pkt + 40, _src[i].xmt);
+    _udp[i].write(pkt, sizeof(pkt));
+  }
+}
+
+// Called by the AsyncUDP task, the reply is processed by update() in loop()
+void Time_Select::receive(uint8_t i, AsyncUDPPacket& packet) {
+  uint64_t dst = ntpNow();
+  if (packet.length() < sizeof(_rxData[i]))
+    return;
+  portENTER_CRITICAL(&_mux);
+  memcpy(_rxData[i], packet.data(), sizeof(_rxData[i]));
+  _rxDst[i] = dst;
+  _rxReady[i] = true;
+  portEXIT_CRITICAL(&_mux);
+}
+
+// RFC 5905 A.5.1 receive() and packet(), server replies only
+void Time_Select::process(uint8_t i) {
+  uint8_t pkt[48];
+  uint64_t dst;
+  portENTER_CRITICAL(&_mux);
+  memcpy(pkt, _rxData[i], sizeof(pkt));
+  dst = _rxDst[i];
+  _rxReady[i] = false;
+  portEXIT_CRITICAL(&_mux);
+
+  ts_source_t& p = _src[i];
+  uint8_t li = pkt[0] >> 6;
+  uint8_t mode = pkt[0] & 0x07;
+  uint8_t stratum = pkt[1];
+  uint64_t org = get64(pkt + 24);
+  uint64_t rec = get64(pkt + 32);
+  uint64_t xmt = get64(pkt + 40);
+
+  if ((mode != 4) || (!p.xmt) || (org != p.xmt) || (!xmt)) {
+    DBGF("Time source %d: bogus or duplicate reply\n", i);
+    return;
+  }
+  p.xmt = 0;  // a duplicate of this reply will be rejected
+  if ((li == 3) || (stratum == 0) || (stratum >= MAXSTRAT)) {
+    DBGF("Time source %d: not synchronized (li %d, stratum %d)\n", i, li, stratum);
+    return;
+  }
+
+  p.reach |= 1;
+  p.stratum = stratum;
+  p.precision = (int8_t) pkt[3];
+  p.rootDelay = get32(pkt + 4) / 65536.0;
+  p.rootDisp = get32(pkt + 8) / 65536.0;
+  memcpy(&p.refId, pkt + 12, 4);
+
+  // T1 = org, T2 = rec, T3 = xmt, T4 = dst
+  double offset = ((int64_t) (rec - org) + (int64_t) (xmt - dst)) / (2*FRAC);
+  double delay = ((int64_t) (dst - org) - (int64_t) (xmt - rec)) / FRAC;
+  if (delay < ldexp(1, _precision))
+    delay = ldexp(1, _precision);
+  double disp = ldexp(1, p.precision) + ldexp(1, _precision) + PHI*((int64_t) (dst - org) / FRAC);
+  clockFilter(i, offset, delay, disp);
+}
+
+// RFC 5905 A.5.2 clock_filter()
+void Time_Select::clockFilter(uint8_t i, double offset, double delay, double disp) {
+  ts_source_t& p = _src[i];
+  for (int s = TS_NSTAGE - 1; s > 0; s--)
+    p.filter[s] = p.filter[s-1];
+  p.filter[0].offset = offset;
+  p.filter[0].delay = delay;
+  p.filter[0].disp = disp;
+  p.filter[0].t = millis();
+
+  // sort the stages by delay, empty stages last
+  uint8_t order[TS_NSTAGE];
+  for (uint8_t s = 0; s < TS_NSTAGE; s++) {
+    uint8_t j = s;
+    double d = (p.filter[s].t) ? p.filter[s].delay : 2*MAXDISP;
+    while ((j > 0) && (((p.filter[order[j-1]].t) ? p.filter[order[j-1]].delay : 2*MAXDISP) > d)) {
+      order[j] = order[j-1];
+      j--;
+    }
+    order[j] = s;
+  }
+
+  const ts_sample_t& best = p.filter[order[0]];
+  p.disp = 0;
+  p.jitter = 0;
+  uint8_t n = 0;
+  for (uint8_t s = 0; s < TS_NSTAGE; s++) {
+    const ts_sample_t& f = p.filter[order[s]];
+    double d = (f.t) ? f.disp + PHI*age(f.t) : MAXDISP;
+    p.disp += ((d < MAXDISP) ? d : MAXDISP) / (2 << s);
+    if (f.t) {
+      p.jitter += (f.offset - best.offset)*(f.offset - best.offset);
+      n++;
+    }
+  }
+  p.jitter = (n > 1) ? sqrt(p.jitter/(n - 1)) : 0;
+  if (p.jitter < ldexp(1, _precision))
+    p.jitter = ldexp(1, _precision);
+
+  // only a sample newer than the one last used is of interest
+  if ((int32_t) (best.t - p.t) > 0)
+    _newSample = true;
+  p.offset = best.offset;
+  p.delay = best.delay;
+  p.t = best.t;
+}
+
+// RFC 5905 A.5.5.2 root_dist()
+double Time_Select::rootDist(uint8_t i) {
+  ts_source_t& p = _src[i];
+  double d = p.rootDelay + p.delay;
+  return ((d > MINDISP) ? d : MINDISP)/2 + p.rootDisp + p.disp + PHI*age(p.t) + p.jitter;
+}
+
+// RFC 5905 A.5.5.2 fit()
+bool Time_Select::fit(uint8_t i) {
+  ts_source_t& p = _src[i];
+  if ((!p.reach) || (!p.t) || (p.stratum >= MAXSTRAT))
+    return false;
+  if (rootDist(i) > MAXDIST + PHI*PEER_POLL_TIME/1000.0)
+    return false;
+  // a peer synchronized to this server would make a timing loop
+  if ((i != TS_GPS) && (p.refId == _local))
+    return false;
+  return true;
+}
+
+// RFC 5905 A.5.5.1 clock_select(), A.5.5.3 cluster and A.5.5.5 clock_combine()
+void Time_Select::clockSelect(void) {
+  uint8_t cand[TS_MAX_SOURCES];
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < _sources; i++) {
+    if (fit(i))
+      cand[n++] = i;
+  }
+
+  // intersection algorithm, lower edges have type +1, upper edges -1
+  struct {
+    double edge;
+    int8_t type;
+  } m[3*TS_MAX_SOURCES], e;
+  uint8_t k = 0;
+  for (uint8_t c = 0; c < n; c++) {
+    double rd = rootDist(cand[c]);
+    double off = _src[cand[c]].offset;
+    double edges[3] = {off - rd, off, off + rd};
+    for (int t = 0; t < 3; t++) {
+      e.edge = edges[t];
+      e.type = 1 - t;
+      int j = k++;
+      while ((j > 0) && (m[j-1].edge > e.edge)) {
+        m[j] = m[j-1];
+        j--;
+      }
+      m[j] = e;
+    }
+  }
+  double low = 0, high = 0;
+  uint8_t allow;
+  for (allow = 0; 2*allow < n; allow++) {
+    int found = 0;
+    int chime = 0;
+    for (int j = 0; j < k; j++) {
+      chime += m[j].type;
+      if (chime >= n - allow) {
+        low = m[j].edge;
+        break;
+      }
+      if (m[j].type == 0)
+        found++;
+    }
+    chime = 0;
+    for (int j = k - 1; j >= 0; j--) {
+      chime -= m[j].type;
+      if (chime >= n - allow) {
+        high = m[j].edge;
+        break;
+      }
+      if (m[j].type == 0)
+        found++;
+    }
+    if (found > allow)
+      continue;
+    if (high > low)
+      break;
+  }
+
+  // survivors sorted by stratum and root distance
+  uint8_t surv[TS_MAX_SOURCES];
+  double metric[TS_MAX_SOURCES];
+  uint8_t ns = 0;
+  if (2*allow < n) {
+    for (uint8_t c = 0; c < n; c++) {
+      uint8_t i = cand[c];
+      if ((_src[i].offset < low) || (_src[i].offset > high))
+        continue;
+      double x = _src[i].stratum*MAXDIST + rootDist(i);
+      int j = ns++;
+      while ((j > 0) && (metric[j-1] > x)) {
+        surv[j] = surv[j-1];
+        metric[j] = metric[j-1];
+        j--;
+      }
+      surv[j] = i;
+      metric[j] = x;
+    }
+  }
+
+  if (!ns) {
+    if (_sysPeer >= 0)
+      DBG("No time source survived, not synchronized");
+    _sysPeer = -1;
+    _stratum = MAXSTRAT;
+    memcpy(&_refId, "INIT", 4);
+    return;
+  }
+
+  // cluster algorithm, discard the survivor with the largest selection jitter
+  // as long as it exceeds the smallest peer jitter
+  while (ns > NMIN) {
+    double maxSel = 0, minPeer = MAXDISP;
+    uint8_t worst = 0;
+    for (uint8_t a = 0; a < ns; a++) {
+      double sel = 0;
+      for (uint8_t b = 0; b < ns; b++) {
+        double d = _src[surv[b]].offset - _src[surv[a]].offset;
+        sel += d*d;
+      }
+      sel = sqrt(sel/(ns - 1));
+      if (sel > maxSel) {
+        maxSel = sel;
+        worst = a;
+      }
+      if (_src[surv[a]].jitter < minPeer)
+        minPeer = _src[surv[a]].jitter;
+    }
+    if (maxSel <= minPeer)
+      break;
+    for (uint8_t a = worst; a < ns - 1; a++)
+      surv[a] = surv[a+1];
+    ns--;
+  }
+
+  // combine the survivors, the system peer is the first one
+  ts_source_t& p = _src[surv[0]];
+  double y = 0, z = 0, w = 0;
+  for (uint8_t a = 0; a < ns; a++) {
+    ts_source_t& q = _src[surv[a]];
+    double x = 1/rootDist(surv[a]);
+    y += x;
+    z += x*q.offset;
+    w += x*(q.offset - p.offset)*(q.offset - p.offset);
+  }
+  double offset = z/y;
+  double jitter = sqrt(w/y);
+
+  #if (ENABLE_DBG > 0)
+  if (_sysPeer != surv[0])
+    DBGF("Time source %d selected as system peer\n", surv[0]);
+  #endif
+  _sysPeer = surv[0];
+  _stratum = p.stratum + 1;
+  if (_sysPeer == TS_GPS)
+    _refId = p.refId;
+  else
+    _refId = (uint32_t) p.addr;
+  _rootDelay = p.rootDelay + p.delay;
+  _rootDisp = p.rootDisp + p.disp + sqrt(p.jitter*p.jitter + jitter*jitter) + PHI*age(p.t) + fabs(offset);
+
+  // steer the clock only with a sample not already used
+  if ((int32_t) (p.t - _lastUpdate) > 0) {
+    _lastUpdate = p.t;
+    steer(offset);
+  }
+}
+
+void Time_Select::steer(double offset) {
+  int64_t us = llround(offset*1e6);
+  if (fabs(offset) > STEPT) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    us += (int64_t) tv.tv_sec*1000000 + tv.tv_usec;
+    tv.tv_sec = us / 1000000;
+    tv.tv_usec = us % 1000000;
+    if (settimeofday(&tv, NULL)) {
+      DBGF("Error stepping time, errno = %d\n", errno);
+      return;
+    }
+    DBGF("Time stepped by %.6f s\n", offset);
+  } else {
+    struct timeval delta;
+    delta.tv_sec = us / 1000000;
+    delta.tv_usec = us % 1000000;
+    if (adjtime(&delta, NULL)) {
+      DBGF("Error slewing time, errno = %d\n", errno);
+      return;
+    }
+    DBGF("Time slewed by %.6f s\n", offset);
+  }
+  // The samples were taken against the clock before the correction. Left
+  // as they are, the next selection would apply the same correction again.
+  shiftFilters(offset);
+  gettimeofday(&_refTime, NULL);
+}
+
+// Corrects the samples of all sources after the clock was stepped or
+// slewed by offset
+void Time_Select::shiftFilters(double offset) {
+  for (uint8_t i = 0; i < _sources; i++) {
+    ts_source_t& p = _src[i];
+    p.offset -= offset;
+    for (uint8_t s = 0; s < TS_NSTAGE; s++)
+      p.filter[s].offset -= offset;
+  }
+}
@@ -0,0 +1,128 @@
+// time_select.h
+//
+// Selection of the best time source among the GPS receiver and NTP servers
+// on the local area network, and steering of the ESP RTC from that source.
+//
+// Each LAN peer is polled as a client. Samples from the peers and from the
+// GPS go through the clock filter, selection, cluster and combine algorithms
+// of RFC 5905 (section 10, 11.2 and Appendix A.5). The resulting system
+// variables (stratum, refId, root delay and dispersion) describe the
+// selected source honestly: when no source survives, the system is not
+// synchronized and should be advertised as stratum 16 with leap indicator 3.
+//
+#pragma once
+
+#include "Arduino.h"
+#include "AsyncUDP.h"
+
+// Maximum number of NTP servers on the LAN that can be polled
+#define TS_MAX_PEERS 4
+
+// The GPS is source 0, the peers follow
+#define TS_MAX_SOURCES (TS_MAX_PEERS + 1)
+#define TS_GPS 0
+
+// Number of samples in the clock filter of each source
+#define TS_NSTAGE 8
+
+// Time between polls of the peers and of the GPS in milliseconds
+#if !defined(PEER_POLL_TIME)
+#define PEER_POLL_TIME 64000
+#endif
+
+// Dispersion of a GPS sample in seconds. Without a PPS signal, the time
+// is derived from NMEA messages which are not sent at the top of the second.
+#if !defined(GPS_DISPERSION)
+#define GPS_DISPERSION 0.1
+#endif
+
+typedef struct {
+  double offset;           // s, source time minus system time
+  double delay;            // s, round trip delay
+  double disp;             // s, dispersion when the sample was taken
+  uint32_t t;              // millis() when the sample was taken, 0 if empty
+} ts_sample_t;
+
+typedef struct {
+  IPAddress addr;          // address of the peer, unused for the GPS
+  uint32_t refId;          // reference id of the source, network byte order
+  uint8_t stratum;         // stratum of the source, 0 for the GPS
+  int8_t precision;        // precision of the source clock, log2 s
+  uint8_t reach;           // reachability shift register
+  double rootDelay;        // s, root delay advertised by the source
+  double rootDisp;         // s, root dispersion advertised by the source
+  ts_sample_t filter[TS_NSTAGE];
+  double offset;           // s, clock filter output
+  double delay;            // s
+  double disp;             // s
+  double jitter;           // s
+  uint32_t t;              // millis() of the sample selected by the clock filter
+  uint64_t xmt;            // transmit timestamp of the pending request
+} ts_source_t;
+
+class Time_Select {
+public:
+  Time_Select();
+  ~Time_Select();
+
+  // precision: precision of the system clock, log2 s
+  // local: own IPv4 address, used to detect a peer synchronized to this server
+  bool begin(int8_t precision, const IPAddress& local);
+
+  // Adds an NTP server to poll, returns false if there is no room left
+  bool addPeer(const IPAddress& addr, uint16_t port = 123);
+
+  // Adds a GPS sample, offset is the GPS time minus the system time in seconds
+  void gpsSample(double offset);
+
+  // Call from loop(). Polls the peers, processes their replies and, when a
+  // source has a new sample, selects the system peer and steers the clock.
+  // Returns true when the system variables have been updated.
+  bool update(void);
+
+  // System variables
+  bool synchronized(void) { return _sysPeer >= 0; }
+  uint8_t leap(void) { return synchronized() ? 0 : 3; }
+  uint8_t stratum(void) { return _stratum; }
+  uint32_t refId(void) { return _refId; }          // network byte order
+  const struct timeval& refTime(void) { return _refTime; }
+  double rootDelay(void) { return _rootDelay; }
+  double rootDisp(void) { return _rootDisp; }
+  int sysPeer(void) { return _sysPeer; }            // -1 when not synchronized
+  uint8_t sources(void) { return _sources; }
+  const ts_source_t& source(uint8_t i) { return _src[i]; }
+
+private:
+  ts_source_t _src[TS_MAX_SOURCES];
+  AsyncUDP _udp[TS_MAX_SOURCES];
+  uint8_t _sources;
+  int8_t _precision;
+  uint32_t _local;
+
+  // replies received by the AsyncUDP task, processed in update()
+  uint8_t _rxData[TS_MAX_SOURCES][48];
+  uint64_t _rxDst[TS_MAX_SOURCES];
+  volatile bool _rxReady[TS_MAX_SOURCES];
+  portMUX_TYPE _mux;
+
+  uint32_t _lastPoll;      // millis() of the last poll
+  uint32_t _lastUpdate;    // millis() of the newest sample used to steer the clock
+  bool _newSample;
+
+  int _sysPeer;
+  uint8_t _stratum;
+  uint32_t _refId;
+  struct timeval _refTime;
+  double _rootDelay;
+  double _rootDisp;
+
+  void poll(void);
+  void receive(uint8_t i, AsyncUDPPacket& packet);
+  void process(uint8_t i);
+  void clockFilter(uint8_t i, double offset, double delay, double disp);
+  double rootDist(uint8_t i);
+  bool fit(uint8_t i);
+  void clockSelect(void);
+  void steer(double offset);
+  void shiftFilters(double offset);
+};
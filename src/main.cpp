@@ -17,6 +17,8 @@ on the SeeedStudio XIAO ESP32C3 or XIAO ESP32S3
 #include <Preferences.h>          // save mclock to NVS
 #include "smalldebug.h"           // in lib/
 #include "ntp_server.h"           // in lib/
+#include "time_select.h"          // in lib/
+#include "gps_time.h"             // in lib/
 #include "secrets.h"              // use secrets.h.template to create this file
 #include "TinyGPSPlus.h"          // loaded with platformio directive
 
@@ -27,6 +29,7 @@ on the SeeedStudio XIAO ESP32C3 or XIAO ESP32S3
 
 #if (HAS_OLED > 0)
 #include "SSD1306Wire.h"          // hardware driver for SSD1306 OLED display in .pio/libdeps
+#include "oled_renderer.h"        // in lib/
 #endif
 
 #if (SHOW_NMEA>0) && (!ENABLE_DGB)
@@ -43,9 +46,10 @@ unsigned long timePollInterval = SYNC_POLL_TIME;
 unsigned long timePollInterval = 10000;  // 10 seconds, for Arduino
 #endif
 
-// This is the delay after the first successful update
+// This is the delay after the time is synchronized, it should not be
+// longer than the poll interval of the time source selection
 #if !defined(GPS_POLL_TIME)
-#define GPS_POLL_TIME = 3600000;        // 1 hours, for Arduino
+#define GPS_POLL_TIME 64000        // 64 seconds, for Arduino
 #endif
 
 /**********************/
@@ -54,6 +58,28 @@ unsigned long timePollInterval = 10000;  // 10 seconds, for Arduino
 
 NTP_Server NTPServer;
 
+// Selects the best time source among the GPS and the NTP servers on the LAN
+// listed in NTP_PEERS and steers the ESP RTC
+Time_Select TimeSelect;
+
+#if (ENABLE_DBG > 0)
+// Print the number of requests handled on each interface and address family
+void showNTPCounters(void) {
+  const char* names[] = {"STA", "AP", "ETH"};
+  for (int intf = TCPIP_ADAPTER_IF_STA; intf <= TCPIP_ADAPTER_IF_ETH; intf++) {
+    for (uint8_t family = NTP_FAMILY_IPV4; family <= NTP_FAMILY_IPV6; family++) {
+      const ntp_counters_t& cnt = NTPServer.counters((tcpip_adapter_if_t) intf, family);
+      if (cnt.requests)
+        DBGF("NTP %s IPv%d: %u requests, %u responses, %u dropped\n",
+          names[intf], (family == NTP_FAMILY_IPV6) ? 6 : 4, cnt.requests, cnt.responses, cnt.dropped);
+    }
+  }
+  ntp_load_t load = NTPServer.load();
+  DBGF("NTP load %u permille, %u µs between requests, %u µs per request, poll %u\n",
+    load.permille, load.interval_us, load.service_us, load.poll);
+}
+#endif
+
 
 /*********************************/
 /* * * DS3231 - External RTC * * */
@@ -193,7 +219,7 @@ void clearmclock(void) {
 TinyGPSPlus gps;
 static const uint32_t GPSBaud = 9600;
 
-// Set to true as soon as the ESP RTC is updated with time from the GPS
+// Set to true as soon as the ESP RTC is synchronized to a time source
 bool timesynched = false;
 
 // Serial interface used to talk to the GPS
@@ -215,63 +241,23 @@ static const int TXPin = UART_TX_PIN;
 static const int TXPin = -1;
 #endif
 
-// Updates the ESP32 RTC with the given GPS data which is UTC time
-// to the nearest second and use gpsAge to calculate fractions of a second
-void gpssetime(uint32_t gpsDate, uint32_t gpsTime, uint32_t gpsAge) {
-  DBGF("gpssetime date: %u, time: %u\n", gpsDate, gpsTime);
-  time_t now = 0;
-  struct tm timeinfo;
-
-  div_t delta = div( gpsAge, 1000);
-  gpsTime += delta.quot;
-  timeinfo.tm_sec = (gpsTime / 100) % 100;
-  timeinfo.tm_min = (gpsTime / 10000) % 100;
-  timeinfo.tm_hour = gpsTime / 1000000;
-  timeinfo.tm_mday = gpsDate / 10000;
-  timeinfo.tm_mon = ((gpsDate / 100) % 100) - 1;
-  timeinfo.tm_year = (2000 - 1900) + (gpsDate % 100);
-  timeinfo.tm_wday = -1;
-  timeinfo.tm_yday = -1;
-  timeinfo.tm_isdst = 0;  // UTC does not have daylight saving time
-  // mktime returns the epoch representing the values in the tm structure timeinfo
-  // which it interprets as a **local** time.
-  setenv("TZ", "UTC0", 1);  // revert to UTC time
-  now = mktime(&timeinfo);  // calculates epoch and updates the last three fields
-  if (now <= mclock) {
-    DBG("*** Error: Time going backward ***");
-    return;
-  }
-
-  //DBG("after mktime, timeinfo.tm_hour = %d\n", timeinfo.tm_hour);
-
-  timeval tv;
-  tv.tv_sec = now;
-  tv.tv_usec = 1000 * delta.rem; // milliseconds to microseconds
-  if (settimeofday(&tv, NULL)) { /// defined in ~/.platformio/packages/toolchain-xtensa-esp32/xtensa-esp32-elf/sys-include/sys/time.h
-    DBGF("Error setting time, errno = %d\n", errno);
-  } else {
-    #if (ENABLE_DBG == 1)
-      // read time back
-      struct tm* tinfo;  // defined in ~/.platformio/packages/toolchain-xtensa-esp32/xtensa-esp32-elf/sys-include/time.h
-      time(&now);
-      tinfo = gmtime(&now);
-      char s[51];
-      strftime(s, 50, "%A, %B %d %Y %H:%M:%S", tinfo);
-      DBGF("UTC time set from GPS: %s.%.6u (epoch = %u)\n", s, tv.tv_usec, now);
-    #endif
-    timesynched = true;
-    // now that the time is synchronized, wait longer before performing updates from the GPS data
-    timePollInterval = GPS_POLL_TIME;
-  }
-}
-
+// A fix older than this, in milliseconds, is not used. TinyGPSPlus commits
+// the date and time of every RMC and GGA message, also when the receiver has
+// no fix and sends the time of its own free running clock (status V). The
+// location is committed only from messages with a fix, so its age tells
+// when the last fix was.
+#if !defined(GPS_MAX_AGE)
+#define GPS_MAX_AGE 2000
+#endif
 
 bool updateRTC(void) {
-  if (gps.date.isValid() && gps.time.isValid() && (gps.date.value())) {
+  if (gps.location.isValid() && (gps.location.age() < GPS_MAX_AGE) &&
+    gps.date.isValid() && gps.time.isValid() && (gps.date.value()) && (gps.time.age() < GPS_MAX_AGE)) {
     // NMEA messages such $GNRMC,,V,,,,,,,,,,M*4E return gps.date.isValid() = true
     // and gps.time.isValid() = true even when UTC Time == 0 and Date == 0
     // so a test that date of !0 is needed!
-    gpssetime(gps.date.value(), gps.time.value(), gps.time.age());
+    // mclock ensures that the RTC is not set back
+    gpssetime(TimeSelect, gps.date.value(), gps.time.value(), gps.time.age(), mclock);
     return true;
   }
   return false;
@@ -289,7 +275,12 @@ char dateBuffer[12];    // date format: 2023:11:31
 //#define SDA  6   // defined in  ~/.platformio/packages/framework-arduinoespressif32/variants/XIAO_ESP32C3/pins_arduino.h
 //#define SCL  7
 
-SSD1306Wire display(0x3c, SDA, SCL, GEOMETRY_128_64);
+#define OLED_ADDRESS 0x3c
+
+SSD1306Wire display(OLED_ADDRESS, SDA, SCL, GEOMETRY_128_64);
+
+// Sends only the changed parts of the display a chunk at a time from loop()
+OLED_Renderer renderer(display, OLED_ADDRESS);
 
 int jitter[3] = {-1, 0, 1};
 int xjit = 0;
@@ -302,7 +293,7 @@ void Show(void) {
   xjit = xjit % 3;
   yjit = yjit % 3;
   display.drawString(64+jitter[xjit], 32+jitter[yjit], dateBuffer);
-  display.display();
+  renderer.commit();
   xjit = xjit % 3;
   yjit = yjit % 3;
 }
@@ -351,7 +342,15 @@ void setup() {
   display.setTextAlignment(TEXT_ALIGN_CENTER);
   display.setFont(ArialMT_Plain_24);
   display.displayOn();
-  Show();
+  // The first frame is sent all at once by the library, giving a
+  // measure of a blocking update
+  display.drawString(64, 2, timeBuffer);
+  display.drawString(64, 32, dateBuffer);
+  uint32_t oledstart = micros();
+  display.display();
+  DBGF("OLED blocking update: %u us\n", micros() - oledstart);
+  if (!renderer.begin())
+    DBG("Unable to start the OLED renderer");
   #endif
 
   IPAddress staip, gateway, mask;
@@ -368,9 +367,30 @@ void setup() {
       delay(50);
   }
   DBGF("Connected to %s\n", WiFi.SSID().c_str());
+  #if (ENABLE_IPV6 > 0)
+  // The link-local address is created now, global addresses are obtained
+  // with SLAAC as router advertisements are received
+  if (!WiFi.enableIpV6())
+    DBG("Unable to enable IPv6");
+  #endif
   delay(100);
   DBGF("Starting NTP server at %s:%d\n", WiFi.localIP().toString().c_str(), 123);
+  #if (ENABLE_IPV6 > 0)
+  DBGF("                   and [%s]:%d\n", WiFi.localIPv6().toString().c_str(), 123);
+  #endif
   NTPServer.begin(123); // 123 is the default port
+  DBGF("NTP server has %d listener(s)\n", NTPServer.listeners());
+
+  TimeSelect.begin(NTPServer.precision(), WiFi.localIP());
+  #if defined(NTP_PEERS)
+  // comma separated list of IPv4 addresses
+  char peers[] = NTP_PEERS;
+  for (char* peer = strtok(peers, ", "); peer; peer = strtok(NULL, ", ")) {
+    IPAddress peerip;
+    if (!peerip.fromString(peer) || !TimeSelect.addPeer(peerip))
+      DBGF("Unable to add NTP peer %s\n", peer);
+  }
+  #endif
   DBG("Completed setup(), starting loop()");
 }
 
@@ -382,10 +402,6 @@ void setup() {
 // Not keeping track of whether it was a success or not.
 unsigned long lastRtcUpdate = 0;
 
-// System millis tick count of the last successful update of the ESP32 RTC from GPS data
-// Used to signify that the time is "approximate"
-unsigned long lastRtcCorrection = 0;
-
 // System millis tick count of the last attept to save the current RTC time to
 // non-volatile storage. This is done independently of whether the RTC has been
 // updated by the GPS or not.
@@ -394,6 +410,10 @@ unsigned long mclocktimer = 0;
 // System millis tock count of the last time the NO GPS FOUND message was shown
 unsigned long lastWarning = 0;
 
+// UTC time of the last update of the clock on the OLED, replaces a delay
+// that stalled loop() for over a second to skip the rest of the 0 second mark
+time_t lastShownTime = 0;
+
 #if (SHOW_NMEA > 0)
 String nmea;
 #endif
@@ -416,19 +436,40 @@ void loop(void) {
     gps.encode(c);
   }
 
+  #if (HAS_OLED > 0)
+  // send at most one chunk of the pending display changes
+  if (renderer.busy() && !renderer.pump()) {
+    DBGF("OLED update: %u bytes over I2C, longest loop stall %u us\n",
+      renderer.lastUpdateBytes(), renderer.longestStall());
+  }
+  #endif
+
   // timePollInterval = SYNC_POLL_TIME (=10000) initially and then
-  // = GPS_POLL_TIME (=360000) after first update
+  // = GPS_POLL_TIME (=64000) once synchronized
   if (millis() - lastRtcUpdate >= timePollInterval) {
-    DBG("Time to update the RTC");
+    DBG("Time to sample the GPS time");
     lastRtcUpdate = millis();
-    if (updateRTC())
-      lastRtcCorrection = millis();
+    updateRTC();
+  }
+
+  // poll the NTP peers, select the best source and steer the RTC
+  if (TimeSelect.update()) {
+    NTPServer.setReference(TimeSelect.leap(), TimeSelect.stratum(), TimeSelect.refId(),
+      TimeSelect.refTime(), TimeSelect.rootDelay(), TimeSelect.rootDisp());
+    if (TimeSelect.synchronized() && !timesynched) {
+      timesynched = true;
+      // now that the time is synchronized, sample the GPS at the peer poll interval
+      timePollInterval = GPS_POLL_TIME;
+    }
   }
 
   if (millis() - mclocktimer >= SAVE_CLOCK_TIME) {
     DBG("Time to set mclock and save it to NVS");
     mclocktimer = millis();
     savemclock();
+    #if (ENABLE_DBG > 0)
+    showNTPCounters();
+    #endif
   }
 
   if ((millis() - lastWarning > GPS_WARNING_TIME) && (gps.charsProcessed() < 10))  {
@@ -438,23 +479,22 @@ void loop(void) {
     display.clear();
     display.drawString(64, 2, "NO GPS");
     display.drawString(64, 32, "FOUND");
-    display.display();
+    renderer.commit();
     #endif
   }
 
   const char* synchedTimeFormat = "%H:%M";
   const char* notSynchedTimeFormat = "~%H:%M~";  // tildes to show time is "approximate"
 
-  // Update clock on OLED at the 0 second mark, allowing for a few seconds window
-  // in case the system is busy for a full second at the start of the "new" minute
-  #define MINUTE_WINDOW 1
+  // Update clock on OLED at the 0 second mark, once only
   time_t lastUTCTime;
-  if  (time(&lastUTCTime) % 60 == 0) {
+  if  ((time(&lastUTCTime) % 60 == 0) && (lastUTCTime != lastShownTime)) {
+    lastShownTime = lastUTCTime;
     struct tm timeinfo;
     // want to show local time, so set the timezone
     setenv("TZ", timeZone, 1);
     localtime_r(&lastUTCTime, &timeinfo);
-    strftime(timeBuffer, sizeof(timeBuffer), ((timesynched)  && (millis() - lastRtcCorrection <= 2*GPS_POLL_TIME))
+    strftime(timeBuffer, sizeof(timeBuffer), (TimeSelect.synchronized())
       ? synchedTimeFormat       
       : notSynchedTimeFormat, &timeinfo);
     strftime(dateBuffer, sizeof(dateBuffer), "%F", &timeinfo);
@@ -462,6 +502,5 @@ void loop(void) {
     #if (HAS_OLED > 0)
     Show();
     #endif
-    delay(MINUTE_WINDOW*1100);  // delay for longer than the 0 second window
   }
 }
@@ -0,0 +1,53 @@
+// On-target benchmark suite
+//
+// Prints the CPU cycle counts of the time critical functions on the
+// ESP32-C3 or ESP32-S3, to be compared with stored baselines by
+// utils/benchcmp.py. The suite is in lib/benchmark/bench_suite.cpp, the
+// host variant in test/native/test_benchmark runs the same functions.
+// It runs in the board environments, pio test -e seeed_xiao_esp32c3, and
+// in the bench_ environments which build it without the debug messages
+// that would otherwise be timed along with the code:
+//
+//   pio test -e bench_seeed_xiao_esp32c3 -v | utils/benchcmp.py
+//
+#include <Arduino.h>
+#include <unity.h>
+#include "bench_suite.h"
+
+static void checkResult(const bench_result_t& res, uint32_t iterations) {
+  TEST_ASSERT_EQUAL(iterations, res.iterations);
+  TEST_ASSERT_TRUE(res.min > 0);
+  TEST_ASSERT_TRUE(res.min <= res.median);
+  TEST_ASSERT_TRUE(res.median <= res.max);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_make_response(void) {
+  checkResult(benchMakeResponse(), BENCH_ITERATIONS);
+}
+
+void test_gpssetime(void) {
+  checkResult(benchGpsSetTime(), BENCH_ITERATIONS);
+}
+
+void test_determine_precision(void) {
+  checkResult(benchDeterminePrecision(), BENCH_PRECISION_ITERATIONS);
+}
+
+void test_nmea_ingest(void) {
+  checkResult(benchNmeaIngest(), BENCH_ITERATIONS);
+}
+
+void setup() {
+  delay(2000);   // time for the test runner to open the serial port
+  UNITY_BEGIN();
+  RUN_TEST(test_make_response);
+  RUN_TEST(test_gpssetime);
+  RUN_TEST(test_determine_precision);
+  RUN_TEST(test_nmea_ingest);
+  UNITY_END();
+}
+
+void loop() {}
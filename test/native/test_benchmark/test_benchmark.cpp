@@ -0,0 +1,79 @@
+// Host variant of the benchmark suite
+//
+// The fixtures of lib/benchmark/bench_suite.cpp are checked and then the
+// suite is run as on the boards, see test/embedded/test_benchmark. The
+// BENCH lines printed by benchmark() are keyed by the "native" target so
+// they can be kept in the same baseline file as the on-target results,
+// see utils/benchcmp.py:
+//
+//   pio test -e native -f native/test_benchmark -v | utils/benchcmp.py
+//
+#include <unity.h>
+#include "bench_suite.h"
+#include "ntp_server.h"
+#include "gps_time.h"
+#include "TinyGPSPlus.h"
+
+static void checkResult(const bench_result_t& res, uint32_t iterations) {
+  TEST_ASSERT_EQUAL(iterations, res.iterations);
+  TEST_ASSERT_TRUE(res.min > 0);
+  TEST_ASSERT_TRUE(res.min <= res.median);
+  TEST_ASSERT_TRUE(res.median <= res.max);
+  TEST_ASSERT_TRUE(res.mean <= res.max);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_make_response(void) {
+  ntp_packet_t reply;
+  TEST_ASSERT_TRUE(NTP_Server::makeResponse(benchRequest, sizeof(benchRequest), reply));
+  TEST_ASSERT_EQUAL(4, reply.flags.mode);
+  TEST_ASSERT_EQUAL(17, reply.poll);   // not booked, see bench_suite.h
+  TEST_ASSERT_FALSE(NTP_Server::makeResponse(benchRequest, 47, reply));
+  checkResult(benchMakeResponse(), BENCH_ITERATIONS);
+}
+
+void test_gpssetime(void) {
+  timeval tv;
+  // 2099-12-31 23:59:59.50 received 250 ms ago
+  gpstime(311299, 23595950, 250, &tv);
+  TEST_ASSERT_EQUAL(4102444799LL, (long long) tv.tv_sec);
+  TEST_ASSERT_EQUAL(750000, tv.tv_usec);
+  // 2024-02-29 12:00:00.00 received 1.5 s ago rolls over the second
+  gpstime(290224, 12000000, 1500, &tv);
+  TEST_ASSERT_EQUAL(1709208001LL, (long long) tv.tv_sec);
+  TEST_ASSERT_EQUAL(500000, tv.tv_usec);
+  // not after notBefore
+  Time_Select ts;
+  ts.begin(-20, IPAddress());
+  TEST_ASSERT_FALSE(gpssetime(ts, 290224, 12000000, 1500, 1709208001));
+  TEST_ASSERT_TRUE(gpssetime(ts, 290224, 12000000, 1500, 1709208000));
+  checkResult(benchGpsSetTime(), BENCH_ITERATIONS);
+}
+
+void test_determine_precision(void) {
+  TEST_ASSERT_TRUE(DeterminePrecision() < 0);
+  checkResult(benchDeterminePrecision(), BENCH_PRECISION_ITERATIONS);
+}
+
+void test_nmea_ingest(void) {
+  TinyGPSPlus gps;
+  for (const char* c = benchNmea; *c; c++)
+    gps.encode(*c);
+  TEST_ASSERT_EQUAL(2, gps.passedChecksum());
+  TEST_ASSERT_EQUAL(0, gps.failedChecksum());
+  TEST_ASSERT_TRUE(gps.location.isValid());
+  TEST_ASSERT_EQUAL_UINT32(230394, gps.date.value());
+  TEST_ASSERT_EQUAL_UINT32(12351900, gps.time.value());
+  checkResult(benchNmeaIngest(), BENCH_ITERATIONS);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_make_response);
+  RUN_TEST(test_gpssetime);
+  RUN_TEST(test_determine_precision);
+  RUN_TEST(test_nmea_ingest);
+  return UNITY_END();
+}
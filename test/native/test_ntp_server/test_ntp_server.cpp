@@ -0,0 +1,183 @@
+// Loopback test of the NTP server
+//
+// The server listens on the IPv4 and IPv6 any addresses of the host as it
+// does on the ESP32. Requests are sent to 127.0.0.1 and ::1 and the replies
+// and the per family counters are checked.
+//
+#include <unity.h>
+#include "ntp_server.h"
+
+// Unprivileged port used instead of 123
+#define TEST_PORT 12123
+
+static NTP_Server server;
+
+static uint32_t get32(const uint8_t* p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Sends a client request from a new socket and returns the length of the
+// reply, 0 if there was none
+static size_t exchange(int family, const uint8_t* request, size_t len, uint8_t* reply) {
+  int fd = socket(family, SOCK_DGRAM, 0);
+  TEST_ASSERT_TRUE(fd >= 0);
+  struct sockaddr_storage sa = {};
+  socklen_t salen;
+  if (family == AF_INET6) {
+    struct sockaddr_in6* sa6 = (struct sockaddr_in6*) &sa;
+    sa6->sin6_family = AF_INET6;
+    sa6->sin6_addr = in6addr_loopback;
+    sa6->sin6_port = htons(TEST_PORT);
+    salen = sizeof(*sa6);
+  } else {
+    struct sockaddr_in* sa4 = (struct sockaddr_in*) &sa;
+    sa4->sin_family = AF_INET;
+    sa4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa4->sin_port = htons(TEST_PORT);
+    salen = sizeof(*sa4);
+  }
+  TEST_ASSERT_EQUAL((ssize_t) len, sendto(fd, request, len, 0, (struct sockaddr*) &sa, salen));
+  hostDispatch(1000);
+
+  struct pollfd pfd = {fd, POLLIN, 0};
+  ssize_t n = 0;
+  if (poll(&pfd, 1, 200) > 0)
+    n = recv(fd, reply, 48, 0);
+  close(fd);
+  return (n > 0) ? n : 0;
+}
+
+static bool hasIPv6Loopback(void) {
+  int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return false;
+  struct sockaddr_in6 sa = {};
+  sa.sin6_family = AF_INET6;
+  sa.sin6_addr = in6addr_loopback;
+  bool ok = (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) == 0);
+  close(fd);
+  return ok;
+}
+
+static void makeRequest(uint8_t* request) {
+  memset(request, 0, 48);
+  request[0] = (4 << 3) | 3;   // li 0, version 4, client mode
+  for (int i = 40; i < 48; i++)
+    request[i] = i;            // transmit timestamp
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_listeners(void) {
+  TEST_ASSERT_EQUAL(2, server.listeners());
+}
+
+void test_unsynchronized_reply(void) {
+  uint8_t request[48], reply[48];
+  makeRequest(request);
+  ntp_counters_t before = server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV4);
+
+  TEST_ASSERT_EQUAL(48, exchange(AF_INET, request, sizeof(request), reply));
+  TEST_ASSERT_EQUAL_HEX8((3 << 6) | (4 << 3) | 4, reply[0]);   // li 3, version 4, server mode
+  TEST_ASSERT_EQUAL(16, reply[1]);
+  TEST_ASSERT_EQUAL_MEMORY("INIT", reply + 12, 4);
+  TEST_ASSERT_EQUAL_MEMORY(request + 40, reply + 24, 8);      // origin = client transmit
+  TEST_ASSERT_EQUAL_UINT32(0, get32(reply + 16));             // never set
+
+  const ntp_counters_t& after = server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV4);
+  TEST_ASSERT_EQUAL_UINT32(before.requests + 1, after.requests);
+  TEST_ASSERT_EQUAL_UINT32(before.responses + 1, after.responses);
+}
+
+void test_ipv4_reply(void) {
+  struct timeval ref;
+  gettimeofday(&ref, NULL);
+  uint32_t refId;
+  memcpy(&refId, "GPS", 4);
+  NTP_Server::setReference(0, 1, refId, ref, 0, 0.001);
+
+  uint8_t request[48], reply[48];
+  makeRequest(request);
+  TEST_ASSERT_EQUAL(48, exchange(AF_INET, request, sizeof(request), reply));
+  TEST_ASSERT_EQUAL_HEX8((0 << 6) | (4 << 3) | 4, reply[0]);
+  TEST_ASSERT_EQUAL(1, reply[1]);
+  TEST_ASSERT_EQUAL_MEMORY("GPS", reply + 12, 4);
+  TEST_ASSERT_EQUAL_UINT32(ref.tv_sec + 2208988800UL, get32(reply + 16));
+
+  // receive and transmit timestamps within a second of the reference time
+  uint32_t rx = get32(reply + 32);
+  uint32_t tx = get32(reply + 40);
+  TEST_ASSERT_UINT32_WITHIN(1, ref.tv_sec + 2208988800UL, rx);
+  TEST_ASSERT_TRUE(tx >= rx);
+}
+
+void test_ipv6_reply(void) {
+  if (!hasIPv6Loopback())
+    TEST_IGNORE_MESSAGE("no IPv6 loopback on this host");
+  uint8_t request[48], reply[48];
+  makeRequest(request);
+  ntp_counters_t before4 = server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV4);
+  ntp_counters_t before6 = server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV6);
+
+  TEST_ASSERT_EQUAL(48, exchange(AF_INET6, request, sizeof(request), reply));
+  TEST_ASSERT_EQUAL(4, reply[0] & 0x07);
+  TEST_ASSERT_EQUAL_MEMORY(request + 40, reply + 24, 8);
+
+  // counted as IPv6 only
+  TEST_ASSERT_EQUAL_UINT32(before6.requests + 1, server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV6).requests);
+  TEST_ASSERT_EQUAL_UINT32(before6.responses + 1, server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV6).responses);
+  TEST_ASSERT_EQUAL_UINT32(before4.requests, server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV4).requests);
+}
+
+void test_short_request_dropped(void) {
+  uint8_t request[48], reply[48];
+  makeRequest(request);
+  ntp_counters_t before = server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV4);
+
+  TEST_ASSERT_EQUAL(0, exchange(AF_INET, request, 20, reply));
+  const ntp_counters_t& after = server.counters(TCPIP_ADAPTER_IF_STA, NTP_FAMILY_IPV4);
+  TEST_ASSERT_EQUAL_UINT32(before.requests + 1, after.requests);
+  TEST_ASSERT_EQUAL_UINT32(before.dropped + 1, after.dropped);
+  TEST_ASSERT_EQUAL_UINT32(before.responses, after.responses);
+}
+
+// A burst of requests from clients polling every 64 s fills the second
+// 64 s ahead up to 40% of the rate budget. The other clients are asked to
+// poll every 128 s or, once that second is full too, every 256 s. 64 s is
+// advertised again a few seconds later.
+void test_poll_raised_under_load(void) {
+  const int cap = (NTP_RATE_BUDGET*2)/5;
+  hostAdvance(10000*1000UL);   // past all the booked seconds
+  uint8_t request[48];
+  makeRequest(request);
+  request[2] = 6;
+  int polls[256] = {};
+  ntp_packet_t reply;
+  // within one or two seconds
+  for (int i = 0; i < 3*cap; i++) {
+    TEST_ASSERT_TRUE(NTP_Server::makeResponse(request, sizeof(request), reply));
+    polls[reply.poll]++;
+  }
+  TEST_ASSERT_TRUE(polls[6] >= cap);
+  TEST_ASSERT_TRUE(polls[6] <= 2*cap);
+  TEST_ASSERT_TRUE(polls[7] >= cap);
+  TEST_ASSERT_EQUAL(3*cap, polls[6] + polls[7] + polls[8]);
+
+  hostAdvance(3000);
+  TEST_ASSERT_TRUE(NTP_Server::makeResponse(request, sizeof(request), reply));
+  TEST_ASSERT_EQUAL(6, reply.poll);
+  TEST_ASSERT_EQUAL(0, NTP_Server::load().poll);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  server.begin(TEST_PORT);
+  RUN_TEST(test_listeners);
+  RUN_TEST(test_unsynchronized_reply);
+  RUN_TEST(test_ipv4_reply);
+  RUN_TEST(test_ipv6_reply);
+  RUN_TEST(test_short_request_dropped);
+  RUN_TEST(test_poll_raised_under_load);
+  return UNITY_END();
+}
@@ -0,0 +1,137 @@
+// Test of the incremental OLED renderer
+//
+// The I2C transmissions recorded by the Wire stand-in are replayed on a
+// model of the SSD1306 GDDRAM, which must end up equal to the drawing
+// buffer of the display.
+//
+#include <unity.h>
+#include "oled_renderer.h"
+
+#define ADDRESS 0x3c
+
+static uint8_t panel[128*8];
+
+// Applies the recorded COLUMNADDR/PAGEADDR windows and data to panel
+static void replay(TwoWire& wire, uint16_t width) {
+  uint8_t col = 0, colEnd = 0, page = 0;
+  for (const std::vector<uint8_t>& t : wire.transmissions) {
+    TEST_ASSERT_TRUE(t.size() > 0);
+    if (t[0] == 0x00) {
+      TEST_ASSERT_EQUAL(7, t.size());
+      TEST_ASSERT_EQUAL_HEX8(0x21, t[1]);
+      TEST_ASSERT_EQUAL_HEX8(0x22, t[4]);
+      col = t[2];
+      colEnd = t[3];
+      page = t[5];
+    } else {
+      TEST_ASSERT_EQUAL_HEX8(0x40, t[0]);
+      TEST_ASSERT_EQUAL(colEnd - col + 1, t.size() - 1);
+      memcpy(panel + page*width + col, t.data() + 1, t.size() - 1);
+    }
+  }
+  wire.transmissions.clear();
+}
+
+static int pumpAll(OLED_Renderer& renderer) {
+  int calls = 0;
+  while (renderer.busy()) {
+    renderer.pump();
+    calls++;
+    TEST_ASSERT_TRUE(calls < 1000);
+  }
+  return calls;
+}
+
+void setUp(void) {
+  memset(panel, 0, sizeof(panel));
+}
+
+void tearDown(void) {}
+
+void test_failed_begin_is_idle(void) {
+  OLEDDisplay tall(128, 128);   // more pages than OLED_MAX_PAGES
+  TwoWire wire;
+  OLED_Renderer renderer(tall, ADDRESS, wire);
+  TEST_ASSERT_FALSE(renderer.begin());
+  TEST_ASSERT_FALSE(renderer.busy());
+  tall.buffer[0] = 0xFF;
+  renderer.commit();
+  TEST_ASSERT_FALSE(renderer.busy());
+  TEST_ASSERT_FALSE(renderer.pump());
+  TEST_ASSERT_EQUAL(0, wire.transmissions.size());
+}
+
+void test_unchanged_sends_nothing(void) {
+  OLEDDisplay display;
+  TwoWire wire;
+  OLED_Renderer renderer(display, ADDRESS, wire);
+  TEST_ASSERT_TRUE(renderer.begin());
+  renderer.commit();
+  TEST_ASSERT_FALSE(renderer.busy());
+  TEST_ASSERT_EQUAL(0, renderer.lastUpdateBytes());
+  TEST_ASSERT_FALSE(renderer.pump());
+  TEST_ASSERT_EQUAL(0, wire.transmissions.size());
+}
+
+void test_changed_columns(void) {
+  OLEDDisplay display;
+  TwoWire wire;
+  OLED_Renderer renderer(display, ADDRESS, wire);
+  TEST_ASSERT_TRUE(renderer.begin());
+
+  // 50 columns of page 2: two chunks of at most 32 data bytes, each with
+  // a 7 byte window command and a data control byte
+  for (int x = 10; x < 60; x++)
+    display.buffer[2*128 + x] = x;
+  renderer.commit();
+  TEST_ASSERT_EQUAL(2, pumpAll(renderer));
+  TEST_ASSERT_EQUAL(50 + 2*8, renderer.lastUpdateBytes());
+  TEST_ASSERT_EQUAL(renderer.lastUpdateBytes(), wire.bytes());
+  replay(wire, 128);
+  TEST_ASSERT_EQUAL_MEMORY(display.buffer, panel, sizeof(panel));
+}
+
+void test_full_frame(void) {
+  OLEDDisplay display;
+  TwoWire wire;
+  OLED_Renderer renderer(display, ADDRESS, wire);
+  TEST_ASSERT_TRUE(renderer.begin());
+  memset(display.buffer, 0xA5, 128*8);
+  renderer.commit();
+  TEST_ASSERT_EQUAL(8*4, pumpAll(renderer));
+  TEST_ASSERT_EQUAL(1024 + 8*4*8, renderer.lastUpdateBytes());
+  TEST_ASSERT_EQUAL(renderer.lastUpdateBytes(), wire.bytes());
+  replay(wire, 128);
+  TEST_ASSERT_EQUAL_MEMORY(display.buffer, panel, sizeof(panel));
+}
+
+void test_commit_while_sending(void) {
+  OLEDDisplay display;
+  TwoWire wire;
+  OLED_Renderer renderer(display, ADDRESS, wire);
+  TEST_ASSERT_TRUE(renderer.begin());
+  for (int x = 0; x < 64; x++)
+    display.buffer[x] = 1;
+  renderer.commit();
+  TEST_ASSERT_TRUE(renderer.pump());   // first 32 columns sent
+
+  // redraw part of the sent columns and a column past the queued range,
+  // the count covers what was sent before and after the second commit()
+  display.buffer[5] = 2;
+  display.buffer[100] = 3;
+  renderer.commit();
+  pumpAll(renderer);
+  TEST_ASSERT_EQUAL(wire.bytes(), renderer.lastUpdateBytes());
+  replay(wire, 128);
+  TEST_ASSERT_EQUAL_MEMORY(display.buffer, panel, sizeof(panel));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_failed_begin_is_idle);
+  RUN_TEST(test_unchanged_sends_nothing);
+  RUN_TEST(test_changed_columns);
+  RUN_TEST(test_full_frame);
+  RUN_TEST(test_commit_while_sending);
+  return UNITY_END();
+}
@@ -0,0 +1,115 @@
+// Fleet simulation of the load governor of the NTP server
+//
+// Thousands of clients poll NTP_Server::makeResponse() in virtual time,
+// moved forward with hostAdvance() on a stopped host clock. They start over a ramp and randomize
+// each poll interval by 5%, as ntpd and chrony do. Clients of three kinds
+// are mixed:
+//   - clients that send their own poll exponent of 6 and follow the one
+//     in the reply,
+//   - clients that send the exponent they adopted from the last reply,
+//   - clients that poll every 4096 s, beyond the calendar of the governor.
+// The request rate must stay under NTP_RATE_BUDGET over the whole run,
+// ramp included, averaged over 64 s and over 1 s.
+//
+#include <unity.h>
+#include "ntp_server.h"
+#include <queue>
+#include <vector>
+#include <random>
+
+#define CLIENTS 10000
+#define DURATION 86400     // s
+#define RAMP 3600          // s, over which the clients start
+#define JITTER 0.05
+#define CLIENT_POLL 6
+#define SLOW_POLL 12
+#define WINDOW 64          // s
+
+typedef enum {FOLLOWS, ADOPTS, SLOW} client_kind_t;
+
+typedef struct {
+  uint64_t time_ms;        // of the next request
+  uint32_t client;
+} request_t;
+
+struct later {
+  bool operator()(const request_t& a, const request_t& b) const { return a.time_ms > b.time_ms; }
+};
+
+static uint32_t counts[DURATION];      // requests in each second
+
+// Moves millis() to the virtual time t_ms from the start of the run
+static void advanceTo(uint32_t start_ms, uint64_t t_ms) {
+  uint32_t now = millis() - start_ms;
+  if (t_ms > now)
+    hostAdvance(t_ms - now);
+}
+
+static double peakRate(uint32_t window) {
+  uint64_t total = 0;
+  uint64_t peak = 0;
+  for (uint32_t s = 0; s < DURATION; s++) {
+    total += counts[s];
+    if (s >= window)
+      total -= counts[s - window];
+    if (total > peak)
+      peak = total;
+  }
+  return (double) peak / window;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_fleet_under_budget(void) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> jitter(1 - JITTER, 1 + JITTER);
+  std::uniform_int_distribution<uint64_t> ramp(0, RAMP*1000ULL);
+
+  std::vector<uint8_t> polls(CLIENTS);
+  std::priority_queue<request_t, std::vector<request_t>, later> queue;
+  for (uint32_t c = 0; c < CLIENTS; c++) {
+    polls[c] = (c % 3 == SLOW) ? SLOW_POLL : CLIENT_POLL;
+    queue.push({ramp(rng), c});
+  }
+
+  uint8_t request[48] = {0x1b};
+  ntp_packet_t reply;
+  uint32_t raised = 0;
+  uint32_t slowRaised = 0;
+  hostStopClock();
+  hostAdvance(1000 - millis() % 1000);   // start on a calendar second
+  uint32_t start_ms = millis();
+  while (queue.top().time_ms < DURATION*1000ULL) {
+    request_t req = queue.top();
+    queue.pop();
+    advanceTo(start_ms, req.time_ms);
+    counts[req.time_ms / 1000]++;
+
+    client_kind_t kind = (client_kind_t) (req.client % 3);
+    request[2] = (kind == FOLLOWS) ? CLIENT_POLL : polls[req.client];
+    TEST_ASSERT_TRUE(NTP_Server::makeResponse(request, sizeof(request), reply));
+    TEST_ASSERT_TRUE(reply.poll >= request[2]);
+    if (reply.poll > request[2])
+      raised++;
+    if ((kind == SLOW) && (reply.poll != SLOW_POLL))
+      slowRaised++;
+    polls[req.client] = reply.poll;
+    queue.push({req.time_ms + (uint64_t) ((1000ULL << reply.poll) * jitter(rng)), req.client});
+  }
+
+  double peak = peakRate(WINDOW);
+  double peak1 = peakRate(1);
+  printf("%u clients, budget %u req/s: peak %.1f req/s over %u s, %.1f req/s over 1 s\n",
+    CLIENTS, NTP_RATE_BUDGET, peak, WINDOW, peak1);
+  TEST_ASSERT_TRUE(raised > 0);          // the governor had to act
+  TEST_ASSERT_EQUAL(0, slowRaised);      // beyond the calendar, left as is
+  TEST_ASSERT_TRUE(peak <= NTP_RATE_BUDGET);
+  TEST_ASSERT_TRUE(peak1 <= NTP_RATE_BUDGET);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fleet_under_budget);
+  return UNITY_END();
+}
@@ -0,0 +1,203 @@
+// Test of the time source selection against stand-in NTP servers
+//
+// Each stand-in server listens on its own loopback port and answers with the
+// host time plus its own offset. The virtual system clock of test/stubs is
+// steered by the time source selection, its offset from the host time is
+// __hostClockOffset_us. The clock and millis() are moved forward one poll
+// interval at a time with hostAdvance().
+//
+#include <unity.h>
+#include "time_select.h"
+
+#define BASE_PORT 12300
+#define NTP_TIMESTAMP_DELTA 2208988800ull
+#define FRAC 4294967296.0
+
+typedef struct {
+  AsyncUDP udp;
+  double offset;           // s, added to the host time
+  uint8_t stratum;
+  bool silent;             // does not answer
+} standin_t;
+
+static standin_t servers[TS_MAX_PEERS];
+
+// On the heap so that it is closed by tearDown() when a test fails
+static Time_Select* ts;
+
+// Polls needed before a source has enough samples in its clock filter for
+// its dispersion to be under the distance threshold
+#define WARMUP 5
+
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  put32(p, v >> 32);
+  put32(p + 4, v);
+}
+
+static uint64_t serverTime(const standin_t& s) {
+  int64_t us = hostTrueTime_us() + llround(s.offset*1e6);
+  return (((uint64_t) (us / 1000000) + NTP_TIMESTAMP_DELTA) << 32) | (((uint64_t) (us % 1000000) << 32) / 1000000);
+}
+
+static void startServers(void) {
+  for (int i = 0; i < TS_MAX_PEERS; i++) {
+    standin_t& s = servers[i];
+    s.offset = 0;
+    s.stratum = 1;
+    s.silent = false;
+    TEST_ASSERT_TRUE(s.udp.listen(IPAddress(127, 0, 0, 1), BASE_PORT + i));
+    s.udp.onPacket([&s](AsyncUDPPacket& packet) {
+      if (s.silent || (packet.length() != 48))
+        return;
+      uint8_t reply[48] = {};
+      uint64_t now = serverTime(s);
+      reply[0] = (0 << 6) | (4 << 3) | 4;   // li 0, version 4, server mode
+      reply[1] = s.stratum;
+      reply[2] = 6;
+      reply[3] = (uint8_t) -20;
+      put32(reply + 4, 0x00000010);         // root delay 0.24 ms
+      put32(reply + 8, 0x00000020);         // root dispersion 0.49 ms
+      memcpy(reply + 12, "PPS", 4);
+      put64(reply + 16, now);
+      memcpy(reply + 24, packet.data() + 40, 8);
+      put64(reply + 32, now);
+      put64(reply + 40, now);
+      packet.write(reply, sizeof(reply));
+    });
+  }
+}
+
+static void stopServers(void) {
+  for (int i = 0; i < TS_MAX_PEERS; i++)
+    servers[i].udp.close();
+}
+
+// Runs one poll interval: requests, replies and selection
+static void pollRound(void) {
+  ts->update();
+  while (hostDispatch(50) > 0)
+    ;
+  ts->update();
+  hostAdvance(PEER_POLL_TIME);
+}
+
+static double clockOffset(void) {
+  return __hostClockOffset_us / 1e6;
+}
+
+void setUp(void) {
+  __hostClockOffset_us = 0;
+  startServers();
+  ts = new Time_Select();
+  ts->begin(-20, IPAddress(192, 168, 1, 2));
+}
+
+void tearDown(void) {
+  delete ts;
+  stopServers();
+}
+
+void test_unsynchronized_without_sources(void) {
+  pollRound();
+  TEST_ASSERT_FALSE(ts->synchronized());
+  TEST_ASSERT_EQUAL(3, ts->leap());
+  TEST_ASSERT_EQUAL(16, ts->stratum());
+  uint32_t refId = ts->refId();
+  TEST_ASSERT_EQUAL_MEMORY("INIT", &refId, 4);
+  TEST_ASSERT_EQUAL(0, __hostClockOffset_us);
+}
+
+// Three truechimers about 20 ms ahead and a falseticker 500 ms behind.
+// The clock is slewed once to the truechimers and then stays there, the
+// correction is not applied again with each new sample.
+void test_falseticker_rejected(void) {
+  servers[0].offset = 0.020;
+  servers[1].offset = 0.021;
+  servers[2].offset = -0.500;
+  servers[3].offset = 0.019;
+  for (int i = 0; i < TS_MAX_PEERS; i++)
+    TEST_ASSERT_TRUE(ts->addPeer(IPAddress(127, 0, 0, 1), BASE_PORT + i));
+
+  for (int round = 0; round < WARMUP; round++)
+    pollRound();
+  for (int round = 0; round < 16; round++) {
+    TEST_ASSERT_TRUE(ts->synchronized());
+    TEST_ASSERT_NOT_EQUAL(3, ts->sysPeer());   // source 3 is servers[2]
+    TEST_ASSERT_EQUAL(2, ts->stratum());
+    TEST_ASSERT_DOUBLE_WITHIN(0.002, 0.020, clockOffset());
+    pollRound();
+  }
+  // the falseticker is still 520 ms away from the corrected clock
+  TEST_ASSERT_DOUBLE_WITHIN(0.002, -0.520, ts->source(3).offset);
+}
+
+// The system peer stops answering. Another peer takes over at the latest
+// when the reach register of the silent peer is empty, after 8 polls.
+void test_failover(void) {
+  for (int i = 0; i < 3; i++)
+    TEST_ASSERT_TRUE(ts->addPeer(IPAddress(127, 0, 0, 1), BASE_PORT + i));
+  for (int round = 0; round < WARMUP; round++)
+    pollRound();
+  TEST_ASSERT_TRUE(ts->synchronized());
+  int lost = ts->sysPeer();
+  TEST_ASSERT_TRUE(lost > 0);
+
+  servers[lost - 1].silent = true;
+  int rounds = 0;
+  while ((ts->sysPeer() == lost) && (rounds < 20)) {
+    pollRound();
+    rounds++;
+  }
+  TEST_ASSERT_TRUE(ts->synchronized());
+  TEST_ASSERT_NOT_EQUAL(lost, ts->sysPeer());
+  TEST_ASSERT_LESS_OR_EQUAL(8, rounds);
+  while (rounds++ < 8)
+    pollRound();
+  TEST_ASSERT_EQUAL(0, ts->source(lost).reach);
+  TEST_ASSERT_TRUE(ts->synchronized());
+  TEST_ASSERT_NOT_EQUAL(lost, ts->sysPeer());
+}
+
+// Replies from an unsynchronized server are ignored
+void test_unsynchronized_server_ignored(void) {
+  servers[0].stratum = 16;
+  TEST_ASSERT_TRUE(ts->addPeer(IPAddress(127, 0, 0, 1), BASE_PORT));
+  for (int round = 0; round < WARMUP; round++)
+    pollRound();
+  TEST_ASSERT_FALSE(ts->synchronized());
+  TEST_ASSERT_EQUAL(0, ts->source(1).reach);
+}
+
+// The GPS, 500 ms ahead, is preferred to a peer which agrees with it. The
+// offset is stepped and the samples of the peer are corrected with it.
+void test_gps_step(void) {
+  servers[0].offset = 0.5;
+  TEST_ASSERT_TRUE(ts->addPeer(IPAddress(127, 0, 0, 1), BASE_PORT));
+  for (int round = 0; round < WARMUP + 4; round++) {
+    ts->gpsSample(0.5 - clockOffset());
+    pollRound();
+  }
+  TEST_ASSERT_TRUE(ts->synchronized());
+  TEST_ASSERT_EQUAL(TS_GPS, ts->sysPeer());
+  TEST_ASSERT_EQUAL(1, ts->stratum());
+  TEST_ASSERT_EQUAL_MEMORY("GPS", &ts->source(TS_GPS).refId, 4);
+  TEST_ASSERT_DOUBLE_WITHIN(0.002, 0.5, clockOffset());
+  TEST_ASSERT_DOUBLE_WITHIN(0.002, 0.0, ts->source(1).offset);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_unsynchronized_without_sources);
+  RUN_TEST(test_falseticker_rejected);
+  RUN_TEST(test_failover);
+  RUN_TEST(test_unsynchronized_server_ignored);
+  RUN_TEST(test_gps_step);
+  return UNITY_END();
+}
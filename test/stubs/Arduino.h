@@ -0,0 +1,157 @@
+// Arduino.h
+//
+// Host stand-in for the parts of the Arduino ESP32 core used by the
+// libraries in lib/, for the native test environment only.
+//
+// The system clock seen by the libraries is virtual: it is the host clock
+// plus an offset changed by settimeofday() and adjtime(), so that the time
+// source selection can steer it without touching the host clock. Both it
+// and millis() can be moved forward with hostAdvance() to run poll
+// intervals without waiting; after hostStopClock() they only move that way.
+//
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <string>
+#include <functional>
+
+#define PI          3.1415926535897932384626433832795
+#define HALF_PI     1.5707963267948966192313216916398
+#define TWO_PI      6.283185307179586476925286766559
+#define DEG_TO_RAD  0.017453292519943295769236907684886
+#define RAD_TO_DEG  57.295779513082320876798154814105
+
+#define radians(deg) ((deg)*DEG_TO_RAD)
+#define degrees(rad) ((rad)*RAD_TO_DEG)
+#define sq(x) ((x)*(x))
+
+typedef uint8_t byte;
+typedef std::string String;
+
+/* Time */
+
+inline uint64_t __hostAdvance_us = 0;     // added by hostAdvance()
+inline int64_t __hostClockOffset_us = 0;  // virtual system clock minus host clock
+
+inline bool __hostStopped = false;        // set by hostStopClock()
+
+// Reads a host clock in µs, or the time it was last read once stopped
+inline uint64_t __hostClock_us(clockid_t id) {
+  static uint64_t last[2];
+  uint64_t& at = last[id == CLOCK_MONOTONIC];
+  if (!__hostStopped) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    at = (uint64_t) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+  }
+  return at;
+}
+
+inline uint64_t __hostMicros(void) {
+  return __hostClock_us(CLOCK_MONOTONIC) + __hostAdvance_us;
+}
+
+inline uint32_t millis(void) { return __hostMicros() / 1000; }
+inline uint32_t micros(void) { return __hostMicros(); }
+inline void delay(uint32_t ms) { usleep(ms*1000); }
+
+// Moves millis(), micros() and the system clock forward
+inline void hostAdvance(uint32_t ms) { __hostAdvance_us += (uint64_t) ms*1000; }
+
+// Stops the host clocks so that runs do not depend on the speed of the host
+inline void hostStopClock(void) {
+  __hostClock_us(CLOCK_MONOTONIC);
+  __hostClock_us(CLOCK_REALTIME);
+  __hostStopped = true;
+}
+
+// Host time plus hostAdvance(), the "true" time against which the virtual
+// system clock is off by __hostClockOffset_us
+inline int64_t hostTrueTime_us(void) {
+  return __hostClock_us(CLOCK_REALTIME) + __hostAdvance_us;
+}
+
+inline int hostGettimeofday(struct timeval* tv, void*) {
+  int64_t us = hostTrueTime_us() + __hostClockOffset_us;
+  tv->tv_sec = us / 1000000;
+  tv->tv_usec = us % 1000000;
+  return 0;
+}
+
+inline int hostSettimeofday(const struct timeval* tv, const void*) {
+  __hostClockOffset_us = (int64_t) tv->tv_sec*1000000 + tv->tv_usec - hostTrueTime_us();
+  return 0;
+}
+
+// The slew is applied at once
+inline int hostAdjtime(const struct timeval* delta, struct timeval* olddelta) {
+  __hostClockOffset_us += (int64_t) delta->tv_sec*1000000 + delta->tv_usec;
+  if (olddelta) {
+    olddelta->tv_sec = 0;
+    olddelta->tv_usec = 0;
+  }
+  return 0;
+}
+
+#define gettimeofday hostGettimeofday
+#define settimeofday hostSettimeofday
+#define adjtime hostAdjtime
+
+/* FreeRTOS critical sections, the host tests are single threaded */
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void) (mux))
+#define portEXIT_CRITICAL(mux) ((void) (mux))
+
+/* Network addresses */
+
+typedef enum {
+  TCPIP_ADAPTER_IF_STA = 0,
+  TCPIP_ADAPTER_IF_AP,
+  TCPIP_ADAPTER_IF_ETH,
+  TCPIP_ADAPTER_IF_MAX
+} tcpip_adapter_if_t;
+
+// Stored in network byte order, as in the ESP32 core
+class IPAddress {
+public:
+  IPAddress() : _addr(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    uint8_t bytes[4] = {a, b, c, d};
+    memcpy(&_addr, bytes, 4);
+  }
+  IPAddress(uint32_t addr) : _addr(addr) {}
+  operator uint32_t() const { return _addr; }
+  bool fromString(const char* s) { return inet_pton(AF_INET, s, &_addr) == 1; }
+  String toString() const {
+    char buf[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &_addr, buf, sizeof(buf));
+  }
+private:
+  uint32_t _addr;
+};
+
+class IPv6Address {
+public:
+  IPv6Address() { memset(_addr, 0, sizeof(_addr)); }
+  IPv6Address(const uint8_t* addr) { memcpy(_addr, addr, sizeof(_addr)); }
+  const uint8_t* bytes() const { return _addr; }
+  bool fromString(const char* s) { return inet_pton(AF_INET6, s, _addr) == 1; }
+  String toString() const {
+    char buf[INET6_ADDRSTRLEN];
+    return inet_ntop(AF_INET6, _addr, buf, sizeof(buf));
+  }
+private:
+  uint8_t _addr[16];
+};
@@ -0,0 +1,179 @@
+// AsyncUDP.h
+//
+// Host stand-in for the AsyncUDP library of the Arduino ESP32 core, for the
+// native test environment only. It uses BSD sockets. Instead of an AsyncUDP
+// task, packet handlers are called by hostDispatch() in the test thread.
+//
+#pragma once
+
+#include "Arduino.h"
+#include <vector>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+class AsyncUDPPacket {
+public:
+  AsyncUDPPacket(int fd, const uint8_t* data, size_t len, const struct sockaddr_storage& remote)
+    : _fd(fd), _data(data), _len(len), _remote(remote) {}
+
+  uint8_t* data() { return (uint8_t*) _data; }
+  size_t length() { return _len; }
+  bool isIPv6() { return _remote.ss_family == AF_INET6; }
+
+  // The host has no notion of ESP32 interfaces, loopback is counted as STA
+  tcpip_adapter_if_t interface() { return TCPIP_ADAPTER_IF_STA; }
+
+  IPAddress remoteIP() {
+    if (isIPv6())
+      return IPAddress();
+    return IPAddress((uint32_t) ((struct sockaddr_in*) &_remote)->sin_addr.s_addr);
+  }
+  IPv6Address remoteIPv6() {
+    if (!isIPv6())
+      return IPv6Address();
+    return IPv6Address(((struct sockaddr_in6*) &_remote)->sin6_addr.s6_addr);
+  }
+  uint16_t remotePort() {
+    return ntohs(isIPv6() ? ((struct sockaddr_in6*) &_remote)->sin6_port : ((struct sockaddr_in*) &_remote)->sin_port);
+  }
+
+  // Replies to the sender
+  size_t write(const uint8_t* data, size_t len) {
+    socklen_t alen = isIPv6() ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    ssize_t n = sendto(_fd, data, len, 0, (const struct sockaddr*) &_remote, alen);
+    return (n < 0) ? 0 : n;
+  }
+
+private:
+  int _fd;
+  const uint8_t* _data;
+  size_t _len;
+  struct sockaddr_storage _remote;
+};
+
+typedef std::function<void(AsyncUDPPacket& packet)> AuPacketHandlerFunction;
+
+class AsyncUDP {
+public:
+  AsyncUDP() : _fd(-1) {}
+  ~AsyncUDP() { close(); }
+
+  bool listen(const IPAddress& addr, uint16_t port) {
+    struct sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = (uint32_t) addr;
+    sa.sin_port = htons(port);
+    return open(AF_INET) && (bind(_fd, (struct sockaddr*) &sa, sizeof(sa)) == 0 || fail());
+  }
+
+  bool listen(const IPv6Address& addr, uint16_t port) {
+    struct sockaddr_in6 sa = {};
+    sa.sin6_family = AF_INET6;
+    memcpy(sa.sin6_addr.s6_addr, addr.bytes(), 16);
+    sa.sin6_port = htons(port);
+    return open(AF_INET6) && (bind(_fd, (struct sockaddr*) &sa, sizeof(sa)) == 0 || fail());
+  }
+
+  bool connect(const IPAddress& addr, uint16_t port) {
+    struct sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = (uint32_t) addr;
+    sa.sin_port = htons(port);
+    return open(AF_INET) && (::connect(_fd, (struct sockaddr*) &sa, sizeof(sa)) == 0 || fail());
+  }
+
+  void onPacket(AuPacketHandlerFunction cb) { _cb = cb; }
+
+  // Sends to the connected address
+  size_t write(const uint8_t* data, size_t len) {
+    if (_fd < 0)
+      return 0;
+    ssize_t n = send(_fd, data, len, 0);
+    return (n < 0) ? 0 : n;
+  }
+
+  // Local port, useful when listening on port 0
+  uint16_t localPort() {
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    if ((_fd < 0) || getsockname(_fd, (struct sockaddr*) &sa, &len))
+      return 0;
+    return ntohs((sa.ss_family == AF_INET6) ? ((struct sockaddr_in6*) &sa)->sin6_port : ((struct sockaddr_in*) &sa)->sin_port);
+  }
+
+  void close() {
+    if (_fd < 0)
+      return;
+    ::close(_fd);
+    _fd = -1;
+    for (size_t i = 0; i < sockets().size(); i++) {
+      if (sockets()[i] == this) {
+        sockets().erase(sockets().begin() + i);
+        break;
+      }
+    }
+  }
+
+  // Waits up to timeout_ms for packets and passes them to the handlers,
+  // returns the number of packets handled
+  static int dispatch(uint32_t timeout_ms) {
+    std::vector<struct pollfd> fds;
+    for (AsyncUDP* u : sockets())
+      fds.push_back({u->_fd, POLLIN, 0});
+    if (fds.empty() || (poll(fds.data(), fds.size(), timeout_ms) <= 0))
+      return 0;
+    std::vector<AsyncUDP*> ready;
+    for (size_t i = 0; i < fds.size(); i++) {
+      if (fds[i].revents & POLLIN)
+        ready.push_back(sockets()[i]);
+    }
+    int count = 0;
+    for (AsyncUDP* u : ready) {
+      uint8_t buf[1500];
+      struct sockaddr_storage remote;
+      socklen_t len = sizeof(remote);
+      ssize_t n = recvfrom(u->_fd, buf, sizeof(buf), 0, (struct sockaddr*) &remote, &len);
+      if (n < 0)
+        continue;
+      count++;
+      if (u->_cb) {
+        AsyncUDPPacket packet(u->_fd, buf, n, remote);
+        u->_cb(packet);
+      }
+    }
+    return count;
+  }
+
+private:
+  int _fd;
+  AuPacketHandlerFunction _cb;
+
+  static std::vector<AsyncUDP*>& sockets() {
+    static std::vector<AsyncUDP*> list;
+    return list;
+  }
+
+  bool open(int family) {
+    close();
+    _fd = socket(family, SOCK_DGRAM, 0);
+    if (_fd < 0)
+      return false;
+    int on = 1;
+    // lwIP keeps IPv4 and IPv6 pcbs apart
+    if (family == AF_INET6)
+      setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+    sockets().push_back(this);
+    return true;
+  }
+
+  bool fail() {
+    close();
+    return false;
+  }
+};
+
+// Handles the packets received by all the AsyncUDP objects
+inline int hostDispatch(uint32_t timeout_ms) {
+  return AsyncUDP::dispatch(timeout_ms);
+}
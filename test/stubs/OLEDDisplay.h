@@ -0,0 +1,26 @@
+// OLEDDisplay.h
+//
+// Host stand-in for the drawing buffer of the ThingPulse OLEDDisplay class,
+// for the native test environment only. Pixels are set in buffer directly.
+//
+#pragma once
+
+#include "Arduino.h"
+
+class OLEDDisplay {
+public:
+  uint8_t* buffer;
+
+  OLEDDisplay(uint16_t width = 128, uint16_t height = 64) : _width(width), _height(height) {
+    buffer = (uint8_t*) calloc(width * height / 8, 1);
+  }
+  ~OLEDDisplay() { free(buffer); }
+
+  uint16_t width(void) { return _width; }
+  uint16_t height(void) { return _height; }
+  void clear(void) { memset(buffer, 0, _width * _height / 8); }
+
+private:
+  uint16_t _width;
+  uint16_t _height;
+};
@@ -0,0 +1,47 @@
+// Wire.h
+//
+// Host stand-in for the Arduino I2C library, for the native test environment
+// only. Transmissions are recorded instead of being sent.
+//
+#pragma once
+
+#include "Arduino.h"
+#include <vector>
+
+class TwoWire {
+public:
+  // Bytes of each completed transmission
+  std::vector<std::vector<uint8_t>> transmissions;
+
+  void beginTransmission(uint8_t address) {
+    _address = address;
+    _pending.clear();
+  }
+  size_t write(uint8_t data) {
+    _pending.push_back(data);
+    return 1;
+  }
+  size_t write(const uint8_t* data, size_t len) {
+    _pending.insert(_pending.end(), data, data + len);
+    return len;
+  }
+  uint8_t endTransmission(bool sendStop = true) {
+    transmissions.push_back(_pending);
+    _pending.clear();
+    return 0;
+  }
+
+  // Total number of bytes written, I2C address bytes excluded
+  size_t bytes(void) {
+    size_t n = 0;
+    for (const std::vector<uint8_t>& t : transmissions)
+      n += t.size();
+    return n;
+  }
+
+private:
+  uint8_t _address = 0;
+  std::vector<uint8_t> _pending;
+};
+
+inline TwoWire Wire;
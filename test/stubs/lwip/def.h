@@ -0,0 +1,8 @@
+// lwip/def.h
+//
+// Host stand-in for the lwIP byte order functions, for the native test
+// environment only
+//
+#pragma once
+
+#include <arpa/inet.h>
@@ -0,0 +1,92 @@
+#!/usr/bin/python3
+
+## Compares the benchmark results printed by the GNATS benchmark suite
+## to stored baselines
+##
+## The results are the lines starting with "BENCH {" in the verbose output
+## of the test runner, for example
+##   pio test -e bench_seeed_xiao_esp32c3 -v | tee bench.log
+
+#-- user defined macros --
+
+DEFAULT_BASELINE = 'bench_baseline.json'
+DEFAULT_METRIC = 'median'
+DEFAULT_TOLERANCE = 10.0   # percent
+
+#------------------------------
+
+import argparse
+import json
+import sys
+
+def read_results(lines):
+    results = {}
+    for line in lines:
+        pos = line.find('BENCH {')
+        if pos < 0:
+            continue
+        try:
+            res = json.loads(line[pos+6:])
+        except ValueError:
+            continue
+        if 'error' in res:
+            print('{}: {}'.format(res.get('name'), res['error']), file=sys.stderr)
+            continue
+        results['{}/{}'.format(res['target'], res['name'])] = res
+    return results
+
+def main():
+    parser = argparse.ArgumentParser(description="""Compares GNATS benchmark results
+to a baseline. Returns 1 if a result exceeds its baseline by more than the tolerance.""")
+    parser.add_argument('log', nargs='?', help='serial monitor capture, default stdin')
+    parser.add_argument('-b', '--baseline', default=DEFAULT_BASELINE,
+        help='baseline file, default {}'.format(DEFAULT_BASELINE))
+    parser.add_argument('-m', '--metric', default=DEFAULT_METRIC,
+        choices=['cold', 'min', 'median', 'mean', 'max'],
+        help='cycle count compared, default {}'.format(DEFAULT_METRIC))
+    parser.add_argument('-t', '--tolerance', type=float, default=DEFAULT_TOLERANCE,
+        help='allowed increase in percent, default {}'.format(DEFAULT_TOLERANCE))
+    parser.add_argument('-s', '--save', action='store_true',
+        help='add the results to the baseline instead of comparing them')
+    args = parser.parse_args()
+
+    if args.log:
+        with open(args.log, errors='replace') as f:
+            results = read_results(f)
+    else:
+        results = read_results(sys.stdin)
+    if not results:
+        print('No benchmark results found')
+        return 2
+
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    except FileNotFoundError:
+        baseline = {}
+
+    if args.save:
+        baseline.update(results)
+        with open(args.baseline, 'w') as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+        print('Saved {} results to {}'.format(len(results), args.baseline))
+        return 0
+
+    failed = 0
+    print('{:32} {:>12} {:>12} {:>8}'.format('benchmark', 'baseline', args.metric, 'change'))
+    for key in sorted(results):
+        now = results[key][args.metric]
+        if key not in baseline:
+            print('{:32} {:>12} {:>12} {:>8}'.format(key, '-', now, 'new'))
+            continue
+        ref = baseline[key][args.metric]
+        change = 100.0*(now - ref)/ref if ref else 0.0
+        status = ''
+        if change > args.tolerance:
+            status = '  REGRESSION'
+            failed += 1
+        print('{:32} {:>12} {:>12} {:>+7.1f}%{}'.format(key, ref, now, change, status))
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -27,7 +27,7 @@ def usage():
 Usage:
   nptc.py [-? | -h |--help] [ip | url]
     -?, -h, --help - print this message
-    ip - the IPv4 address of the NTP server to query
+    ip - the IPv4 or IPv6 address of the NTP server to query
     url - the host name of the NTP server to query.""")    
     print("    default - {}\n".format(DEFAULT_SERVER))
     print("""Example:
@@ -59,9 +59,11 @@ print("NTP server '{}' will be queried".format(server))
 TIME1970 = 2208988800  # seconds since 1970.1.1 00:00:00
 
 def sntp_client():
-    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as client:
+    # IPv4 or IPv6 depending on the address or on the host name resolution
+    family, _, _, _, address = socket.getaddrinfo(server, 123, 0, socket.SOCK_DGRAM)[0]
+    with socket.socket(family, socket.SOCK_DGRAM) as client:
         data = '\x1b' + 47 * '\0'
-        client.sendto(data.encode('utf-8'), (server, 123))
+        client.sendto(data.encode('utf-8'), address)
         client.settimeout(5)
         data, address = client.recvfrom(1024)
 
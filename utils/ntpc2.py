@@ -19,7 +19,7 @@ the NTP response record and the current time to the console
 Usage:
   nptc2.py [-? | -h |--help] [ip | url]
     -?, -h, --help - print this message
-    ip - the IPv4 address of the NTP server to query
+    ip - the IPv4 or IPv6 address of the NTP server to query
     url - the host name of the NTP server to query.""")    
     print("    default - {}\n".format(DEFAULT_SERVER))
     print("""Example:
@@ -82,9 +82,11 @@ def showtime(name, s, f):
   
 
 def sntp_client():
-    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as client:
+    # IPv4 or IPv6 depending on the address or on the host name resolution
+    family, _, _, _, address = socket.getaddrinfo(server, 123, 0, socket.SOCK_DGRAM)[0]
+    with socket.socket(family, socket.SOCK_DGRAM) as client:
         data = '\x1b' + 47 * '\0'
-        client.sendto(data.encode('utf-8'), (server, 123))
+        client.sendto(data.encode('utf-8'), address)
         client.settimeout(5)
         data, address = client.recvfrom(1024)
         
@@ -103,10 +105,16 @@ def sntp_client():
         print('  unint32_t rootDelay:      {}'.format(stamps[1]))
         print('  unint32_t rootDispersion: {}'.format(stamps[2]))
 
-        try:
-           s = struct.pack("I", stamps[3]).decode()
-        except:
-           s = data[12:16].hex() 
+        if 2 <= data[1] <= 15:
+           # IPv4 address of the upstream server
+           s = '.'.join(str(b) for b in data[12:16])
+        else:
+           # kiss code (stratum 0), reference clock (stratum 1) or
+           # unsynchronized (stratum 16, usually INIT)
+           try:
+              s = data[12:16].decode().rstrip('\0')
+           except:
+              s = data[12:16].hex()
         print('  unint32_t refId:          {}'.format(s))
 
         print()